@@ -0,0 +1,504 @@
+/* copy_file_range */
+#define _GNU_SOURCE
+#include "backup.h"
+#include "checkpoint.h"
+#include "error.h"
+#include "lz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Where a page of the current batch comes from, besides a buffer slot */
+#define BACKUP_FROM_FILE UINT32_MAX
+#define BACKUP_FROM_KEPT (UINT32_MAX - 1)
+
+struct __backup {
+  table_t* table;
+  /* Only dereferenced under the table lock, and not once cancelled */
+  page_t* pager;
+  char* path;
+  char* tmp_path;
+  /* A dup of the db file's descriptor, so compaction cannot close it under us */
+  int source_fd;
+  int fd;
+  uint32_t page_size;
+  db_bool compressed;
+  db_bool kernel_copy;
+  /* Compressed only: the copy's extent map and where its next extent goes */
+  page_extent_t* map;
+  uint64_t file_length;
+  /* BACKUP_BUFFER_PAGES frames and one for compressing, aligned for O_DIRECT */
+  void* buffer;
+  size_t buffer_size;
+  /* The current batch: buffer slot or BACKUP_FROM_*, and what each page needs */
+  uint32_t from[BACKUP_BATCH_PAGES];
+  page_extent_t extents[BACKUP_BATCH_PAGES];
+  void* kept[BACKUP_BATCH_PAGES];
+  /* Read and written under the table lock */
+  backup_report_t report;
+  char reason[DB_ERROR_MESSAGE_SIZE];
+  pthread_t thread;
+  _Atomic db_bool cancelled;
+  /* Set once the thread no longer takes the table lock */
+  _Atomic db_bool finished;
+};
+
+static db_bool backup_fail(backup_t* backup, const char* reason) {
+  strncpy(backup->reason, reason, DB_ERROR_MESSAGE_SIZE - 1);
+  return db_false;
+}
+
+/*
+Takes the table lock with no checkpoint write in flight, so that a
+page clean in the cache is also what the file holds; db_false, without
+the lock, once cancelled.
+*/
+static db_bool backup_lock(backup_t* backup) {
+  table_t* table = backup->table;
+  if (table->checkpoint != NULL) {
+    checkpoint_lock_idle(table->checkpoint);
+  } else {
+    table_lock(table);
+  }
+  if (atomic_load(&(backup->cancelled))) {
+    table_unlock(table);
+    return db_false;
+  }
+  return db_true;
+}
+
+static db_bool write_fully(int fd, const char* data, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t bytes_written = pwrite(fd, data, length, offset);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return db_false;
+    }
+    data += bytes_written;
+    offset += bytes_written;
+    length -= bytes_written;
+  }
+  return db_true;
+}
+
+/*
+File to file in the kernel. Where copy_file_range() is refused (other
+filesystems, older kernels, O_DIRECT) the rest of the backup goes
+through the buffer instead. Past the end of the db file is a hole.
+*/
+static db_bool copy_range(backup_t* backup, off_t source_offset, off_t offset, size_t length) {
+  while (length > 0 && backup->kernel_copy) {
+    ssize_t copied = copy_file_range(backup->source_fd, &source_offset, backup->fd, &offset,
+                                     length, 0);
+    if (copied > 0) {
+      length -= copied;
+    } else if (copied == 0) {
+      return db_true;
+    } else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+      backup->kernel_copy = db_false;
+    } else if (errno != EINTR) {
+      return backup_fail(backup, "Error copying the db file.");
+    }
+  }
+
+  size_t buffer_size = (size_t)BACKUP_BUFFER_PAGES * backup->page_size;
+  while (length > 0) {
+    ssize_t bytes_read = pread(backup->source_fd, backup->buffer,
+                               length < buffer_size ? length : buffer_size, source_offset);
+    if (bytes_read == 0) {
+      return db_true;
+    }
+    if (bytes_read == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return backup_fail(backup, "Error reading the db file.");
+    }
+    if (!write_fully(backup->fd, backup->buffer, bytes_read, offset)) {
+      return backup_fail(backup, "Error writing the backup.");
+    }
+    source_offset += bytes_read;
+    offset += bytes_read;
+    length -= bytes_read;
+  }
+  return db_true;
+}
+
+static uint32_t extent_size(uint32_t length) {
+  return (length + PAGE_EXTENT_ALIGN - 1) / PAGE_EXTENT_ALIGN * PAGE_EXTENT_ALIGN;
+}
+
+/* Reserve room at the end of a compressed copy */
+static db_bool backup_append(backup_t* backup, uint64_t size, off_t* offset) {
+  if (backup->file_length + size > UINT32_MAX) {
+    return backup_fail(backup, "Compressed backup is out of space; compact the db first.");
+  }
+  *offset = backup->file_length;
+  backup->file_length += size;
+  return db_true;
+}
+
+/* A page image from memory; compressed copies get a new extent for it */
+static db_bool write_image(backup_t* backup, uint32_t page_num, const void* image) {
+  uint32_t page_size = backup->page_size;
+  if (!backup->compressed || page_num == 0) {
+    if (!write_fully(backup->fd, image, page_size, (off_t)page_num * page_size)) {
+      return backup_fail(backup, "Error writing the backup.");
+    }
+    return db_true;
+  }
+
+  char* data = (char*)backup->buffer + (size_t)BACKUP_BUFFER_PAGES * page_size;
+  uint32_t length = lz_compress(image, page_size, data, page_size - 1);
+  if (length == 0) {
+    memcpy(data, image, page_size);
+    length = page_size;
+  }
+  uint32_t size = extent_size(length);
+  memset(data + length, 0, size - length);
+
+  off_t offset;
+  if (!backup_append(backup, size, &offset)) {
+    return db_false;
+  }
+  if (!write_fully(backup->fd, data, size, offset)) {
+    return backup_fail(backup, "Error writing the backup.");
+  }
+  backup->map[page_num].offset = offset;
+  backup->map[page_num].length = length;
+  return db_true;
+}
+
+/*
+Pages first..first+i-1 that are clean and consecutive, and for
+compressed files stored back to back, go in one copy. Returns the
+number of pages covered.
+*/
+static uint32_t copy_run(backup_t* backup, uint32_t first, uint32_t i, uint32_t count,
+                         db_bool* ok) {
+  uint32_t page_size = backup->page_size;
+  uint32_t page_num = first + i;
+  uint32_t end = i + 1;
+
+  if (!backup->compressed) {
+    while (end < count && backup->from[end] == BACKUP_FROM_FILE) {
+      end++;
+    }
+    *ok = copy_range(backup, (off_t)page_num * page_size, (off_t)page_num * page_size,
+                     (size_t)(end - i) * page_size);
+    return end - i;
+  }
+
+  /* Page 0 is raw at the start; a page with no extent was never written */
+  if (page_num == 0) {
+    *ok = copy_range(backup, 0, 0, page_size);
+    return 1;
+  }
+  page_extent_t* extents = backup->extents;
+  if (extents[i].offset == 0) {
+    *ok = db_true;
+    return 1;
+  }
+  while (end < count && backup->from[end] == BACKUP_FROM_FILE &&
+         extents[end].offset == extents[end - 1].offset + extent_size(extents[end - 1].length)) {
+    end++;
+  }
+
+  uint64_t source_offset = extents[i].offset;
+  uint64_t size = extents[end - 1].offset + extent_size(extents[end - 1].length) - source_offset;
+  off_t offset;
+  *ok = backup_append(backup, size, &offset) &&
+        copy_range(backup, source_offset, offset, size);
+  for (uint32_t j = i; j < end && *ok; j++) {
+    backup->map[first + j].offset = offset + (extents[j].offset - source_offset);
+    backup->map[first + j].length = extents[j].length;
+  }
+  return end - i;
+}
+
+static void free_kept(backup_t* backup, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    free(backup->kept[i]);
+    backup->kept[i] = NULL;
+  }
+}
+
+/*
+Under the lock: decide where each page of the batch comes from, and
+copy out the ones that must come from memory. A batch ends when the
+buffer is full.
+*/
+static uint32_t backup_sort(backup_t* backup, uint32_t first) {
+  page_t* pager = backup->pager;
+  uint32_t slots = 0;
+  uint32_t count = 0;
+  while (first + count < backup->report.num_pages && count < BACKUP_BATCH_PAGES &&
+         slots < BACKUP_BUFFER_PAGES) {
+    uint32_t page_num = first + count;
+    if (pager->snapshot->kept[page_num] != NULL) {
+      backup->kept[count] = page_snapshot_take(pager, page_num);
+      backup->from[count] = BACKUP_FROM_KEPT;
+      backup->report.pages_kept++;
+    } else if (page_is_dirty(pager, page_num)) {
+      page_snapshot_take(pager, page_num);
+      memcpy((char*)backup->buffer + (size_t)slots * backup->page_size, pager->pages[page_num],
+             backup->page_size);
+      backup->from[count] = slots++;
+      backup->report.pages_from_cache++;
+    } else {
+      /* Left for after the copy: the page may still change while the file is read */
+      if (backup->compressed) {
+        backup->extents[count] = pager->map[page_num];
+      }
+      backup->from[count] = BACKUP_FROM_FILE;
+      backup->report.pages_from_file++;
+    }
+    count++;
+  }
+  return count;
+}
+
+/* Without the lock: frames first, since the buffer is reused if the kernel cannot copy */
+static db_bool backup_write_batch(backup_t* backup, uint32_t first, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    const void* image = NULL;
+    if (backup->from[i] == BACKUP_FROM_KEPT) {
+      image = backup->kept[i];
+    } else if (backup->from[i] != BACKUP_FROM_FILE) {
+      image = (char*)backup->buffer + (size_t)backup->from[i] * backup->page_size;
+    }
+    if (image != NULL && !write_image(backup, first + i, image)) {
+      return db_false;
+    }
+  }
+  free_kept(backup, count);
+
+  uint32_t i = 0;
+  while (i < count) {
+    if (backup->from[i] != BACKUP_FROM_FILE) {
+      i++;
+      continue;
+    }
+    db_bool ok;
+    i += copy_run(backup, first, i, count, &ok);
+    if (!ok) {
+      return db_false;
+    }
+  }
+  return db_true;
+}
+
+static db_bool backup_copy(backup_t* backup) {
+  uint32_t first = 0;
+  while (first < backup->report.num_pages) {
+    if (!backup_lock(backup)) {
+      return db_false;
+    }
+    uint32_t count = backup_sort(backup, first);
+    table_unlock(backup->table);
+
+    if (!backup_write_batch(backup, first, count)) {
+      free_kept(backup, count);
+      return db_false;
+    }
+
+    /* A page changed while the file was read has its old frame kept; that one wins */
+    if (!backup_lock(backup)) {
+      return db_false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      if (backup->from[i] == BACKUP_FROM_FILE) {
+        backup->kept[i] = page_snapshot_take(backup->pager, first + i);
+        if (backup->kept[i] != NULL) {
+          backup->report.pages_from_file--;
+          backup->report.pages_kept++;
+        }
+      }
+    }
+    backup->report.pages_done = first + count;
+    backup->report.kernel_copy = backup->kernel_copy;
+    table_unlock(backup->table);
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (backup->kept[i] != NULL && !write_image(backup, first + i, backup->kept[i])) {
+        free_kept(backup, count);
+        return db_false;
+      }
+    }
+    free_kept(backup, count);
+    first += count;
+  }
+  return db_true;
+}
+
+static void sync_parent_dir(const char* filename) {
+  char* path = strdup(filename);
+  int fd = open(dirname(path), O_RDONLY);
+  free(path);
+  if (fd == -1) {
+    return;
+  }
+  fsync(fd);
+  close(fd);
+}
+
+/* The map goes in last, then the copy is synced and renamed into place */
+static db_bool backup_complete(backup_t* backup) {
+  off_t length = (off_t)backup->report.num_pages * backup->page_size;
+  if (backup->compressed) {
+    if (!write_fully(backup->fd, (const char*)backup->map, PAGE_MAP_SIZE, backup->page_size)) {
+      return backup_fail(backup, "Error writing the backup.");
+    }
+    length = backup->file_length;
+  }
+  if (ftruncate(backup->fd, length) == -1 || fsync(backup->fd) == -1) {
+    return backup_fail(backup, "Error syncing the backup.");
+  }
+  close(backup->fd);
+  backup->fd = -1;
+  if (rename(backup->tmp_path, backup->path) == -1) {
+    return backup_fail(backup, "Error renaming the backup into place.");
+  }
+  sync_parent_dir(backup->path);
+  return db_true;
+}
+
+static void* backup_main(void* arg) {
+  backup_t* backup = arg;
+  db_bool ok = backup_copy(backup) && backup_complete(backup);
+  if (!ok) {
+    if (backup->fd != -1) {
+      close(backup->fd);
+      backup->fd = -1;
+    }
+    unlink(backup->tmp_path);
+  }
+
+  table_lock(backup->table);
+  db_bool cancelled = atomic_load(&(backup->cancelled));
+  if (!cancelled) {
+    page_snapshot_end(backup->pager);
+  }
+  backup->report.state = ok ? BACKUP_DONE : cancelled ? BACKUP_CANCELLED : BACKUP_FAILED;
+  table_unlock(backup->table);
+
+  atomic_store(&(backup->finished), db_true);
+  return NULL;
+}
+
+static void backup_free(backup_t* backup) {
+  if (backup->fd != -1) {
+    close(backup->fd);
+  }
+  if (backup->source_fd != -1) {
+    close(backup->source_fd);
+  }
+  if (backup->buffer != NULL) {
+    munmap(backup->buffer, backup->buffer_size);
+  }
+  free(backup->map);
+  free(backup->tmp_path);
+  free(backup->path);
+  free(backup);
+}
+
+static db_bool same_file(int fd, const char* path) {
+  struct stat db_stat;
+  struct stat path_stat;
+  return fstat(fd, &db_stat) == 0 && stat(path, &path_stat) == 0 &&
+         db_stat.st_dev == path_stat.st_dev && db_stat.st_ino == path_stat.st_ino;
+}
+
+BackupStartResult table_backup(table_t* table, const char* path) {
+  if (table->backup != NULL) {
+    if (!atomic_load(&(table->backup->finished))) {
+      return BACKUP_ALREADY_RUNNING;
+    }
+    backup_wait(table->backup);
+    table->backup = NULL;
+  }
+  page_t* pager = table->pager;
+  if (same_file(pager->file_descriptor, path)) {
+    return BACKUP_SAME_FILE;
+  }
+
+  /* The copy shows the table as of now: buffered rows first go into the tree */
+  if (table->memtable != NULL) {
+    table_drain(table);
+  }
+
+  backup_t* backup = calloc(1, sizeof(backup_t));
+  backup->table = table;
+  backup->pager = pager;
+  backup->path = strdup(path);
+  size_t tmp_len = strlen(path) + strlen(BACKUP_TMP_SUFFIX) + 1;
+  backup->tmp_path = malloc(tmp_len);
+  snprintf(backup->tmp_path, tmp_len, "%s%s", path, BACKUP_TMP_SUFFIX);
+  backup->page_size = pager->page_size;
+  backup->compressed = pager->compressed;
+  backup->kernel_copy = db_true;
+  backup->fd = open(backup->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  backup->source_fd = dup(pager->file_descriptor);
+  backup->buffer_size = (size_t)(BACKUP_BUFFER_PAGES + 1) * pager->page_size;
+  backup->buffer = mmap(NULL, backup->buffer_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (backup->buffer == MAP_FAILED) {
+    backup->buffer = NULL;
+  }
+  if (backup->compressed) {
+    backup->map = calloc(TABLE_MAX_PAGES, sizeof(page_extent_t));
+    backup->file_length = pager->page_size + PAGE_MAP_SIZE;
+  }
+  backup->report.state = BACKUP_RUNNING;
+  backup->report.path = backup->path;
+  backup->report.reason = backup->reason;
+  backup->report.kernel_copy = db_true;
+  atomic_store(&(backup->cancelled), db_false);
+  atomic_store(&(backup->finished), db_false);
+
+  if (backup->fd == -1 || backup->source_fd == -1 || backup->buffer == NULL) {
+    if (backup->fd != -1) {
+      unlink(backup->tmp_path);
+    }
+    backup_free(backup);
+    return BACKUP_CANNOT_CREATE;
+  }
+  page_snapshot_begin(pager);
+  backup->report.num_pages = pager->snapshot->num_pages;
+
+  if (pthread_create(&(backup->thread), NULL, backup_main, backup) != 0) {
+    page_snapshot_end(pager);
+    unlink(backup->tmp_path);
+    backup_free(backup);
+    return BACKUP_CANNOT_CREATE;
+  }
+  table->backup = backup;
+  return BACKUP_STARTED;
+}
+
+db_bool table_backup_status(table_t* table, backup_report_t* report) {
+  if (table->backup == NULL) {
+    return db_false;
+  }
+  *report = table->backup->report;
+  return db_true;
+}
+
+void backup_cancel(backup_t* backup) {
+  atomic_store(&(backup->cancelled), db_true);
+}
+
+void backup_wait(backup_t* backup) {
+  pthread_join(backup->thread, NULL);
+  backup_free(backup);
+}
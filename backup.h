@@ -0,0 +1,72 @@
+#ifndef __BACKUP_H__
+#define __BACKUP_H__
+#include <stdint.h>
+#include "table.h"
+
+// ---------- online backup -------------
+/*
+ * A consistent copy of the db as of the moment the backup starts,
+ * made by a background thread while the table keeps serving. Starting
+ * drains the write buffer and begins a pager snapshot; the thread then
+ * copies the file in page order, taking the table lock only to sort
+ * each batch, once no checkpoint write is in flight:
+ *
+ *   - pages that match their disk image are copied file to file with
+ *     copy_file_range(), so their bytes never pass through user space;
+ *   - pages dirty in the cache are copied from their frame;
+ *   - pages changed before the thread reached them come from the frame
+ *     the snapshot kept aside at the first change (see page_snapshot_t).
+ *
+ * Memory use is a batch buffer plus the pages changed ahead of the
+ * copy. Compressed files are copied extent by extent into a fresh
+ * extent map. The copy is written to <path>.tmp and renamed to <path>
+ * once synced. Compaction cancels a running backup.
+ */
+#define BACKUP_TMP_SUFFIX ".tmp"
+/* Pages sorted per visit under the lock */
+#define BACKUP_BATCH_PAGES 1024
+/* Frames copied out of the cache per batch */
+#define BACKUP_BUFFER_PAGES 64
+
+typedef enum {
+  BACKUP_STARTED,
+  BACKUP_ALREADY_RUNNING,
+  BACKUP_CANNOT_CREATE,
+  BACKUP_SAME_FILE
+} BackupStartResult;
+
+typedef enum {
+  BACKUP_RUNNING,
+  BACKUP_DONE,
+  BACKUP_FAILED,
+  BACKUP_CANCELLED
+} BackupState;
+
+typedef struct {
+  BackupState state;
+  const char* path;
+  /* BACKUP_FAILED: what went wrong */
+  const char* reason;
+  uint32_t num_pages;
+  uint32_t pages_done;
+  /* Copied from the db file, in the kernel unless kernel_copy is false */
+  uint32_t pages_from_file;
+  db_bool kernel_copy;
+  /* Copied from dirty frames */
+  uint32_t pages_from_cache;
+  /* Changed during the backup and copied from the frame kept aside */
+  uint32_t pages_kept;
+} backup_report_t;
+
+typedef struct __backup backup_t;
+
+/* Caller holds the table lock. A finished earlier backup is released first */
+BackupStartResult table_backup(table_t* table, const char* path);
+/* Caller holds the table lock; db_false if no backup was started */
+db_bool table_backup_status(table_t* table, backup_report_t* report);
+/* Caller holds the table lock, e.g. before compaction replaces the pager */
+void backup_cancel(backup_t* backup);
+/* Wait for the thread and release the backup; the caller must not hold the table lock */
+void backup_wait(backup_t* backup);
+
+#endif
@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libdb.h"
+#include "shard.h"
+#include "tree.h"
+#include "db.h"
+#include "stats.h"
+
+// ------------ db_bench -------------
+/*
+ * Runs workloads in-process through libdb, e.g.
+ *   db_bench --benchmarks=fillrandom,readrandom,scan --num=50000
+ * Every benchmark opens the db, runs, then closes it so page writes
+ * and the final file size include the flush. fill* benchmarks start
+ * from an empty file; the others reuse whatever the previous one left.
+ * With --shards=N the same workloads run against a sharded table on
+ * <db>.0 .. <db>.N-1; fills then include waiting for the shard workers.
+ */
+#define DEFAULT_BENCH_DB ".bench.db"
+#define DEFAULT_BENCHMARKS "fillseq,fillrandom,readrandom,readmissing,scan,mixed"
+
+typedef struct {
+  const char* db_name;
+  const char* benchmarks;
+  uint32_t num;
+  uint32_t reads;
+  uint32_t scans;
+  uint32_t scan_length;
+  uint32_t read_percent;
+  uint64_t seed;
+  /* 0 runs on a single libdb handle */
+  uint32_t shards;
+  ShardMode shard_mode;
+  db_options_t db_options;
+} bench_options_t;
+
+/* Exactly one of the two is open */
+typedef struct {
+  libdb_t* db;
+  shard_db_t* sharded;
+} bench_db_t;
+
+typedef struct {
+  bench_db_t* db;
+  libdb_iter_t* iter;
+  shard_iter_t shard_iter;
+} bench_iter_t;
+
+typedef struct {
+  const char* name;
+  uint32_t ops;
+  uint32_t done;
+  uint64_t bytes;
+  uint64_t* latencies;
+  uint64_t start_ns;
+  uint64_t elapsed_ns;
+  stats_snapshot_t start_stats;
+} bench_run_t;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next() {
+  /* xorshift64* */
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+static uint32_t rng_uniform(uint32_t n) {
+  return rng_next() % n;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void make_row(row_t* row, uint64_t key) {
+  row->id = key;
+  snprintf(row->username, COLUMN_USERNAME_SIZE, "user%lu", key);
+  snprintf(row->email, COLUMN_EMAIL_SIZE, "user%lu@example.com", key);
+}
+
+/* Keys 1..n, optionally shuffled */
+static uint32_t* make_keys(uint32_t n, db_bool shuffle) {
+  uint32_t* keys = malloc(sizeof(uint32_t) * (n ? n : 1));
+  for (uint32_t i = 0; i < n; i++) {
+    keys[i] = i + 1;
+  }
+  if (shuffle) {
+    for (uint32_t i = n; i > 1; i--) {
+      uint32_t j = rng_uniform(i);
+      uint32_t tmp = keys[i - 1];
+      keys[i - 1] = keys[j];
+      keys[j] = tmp;
+    }
+  }
+  return keys;
+}
+
+static void run_start(bench_run_t* run, const char* name, uint32_t ops) {
+  run->name = name;
+  run->ops = ops;
+  run->done = 0;
+  run->bytes = 0;
+  run->latencies = malloc(sizeof(uint64_t) * (ops ? ops : 1));
+  stats_snapshot(&(run->start_stats));
+  run->start_ns = now_ns();
+}
+
+static void run_op_done(bench_run_t* run, uint64_t op_start_ns) {
+  run->latencies[run->done++] = now_ns() - op_start_ns;
+}
+
+static uint64_t percentile(uint64_t* sorted, uint32_t n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  uint32_t index = (uint32_t)(p * (n - 1) + 0.5);
+  return sorted[index];
+}
+
+static void run_report(bench_run_t* run, off_t file_size) {
+  stats_snapshot_t end_stats;
+  stats_snapshot(&end_stats);
+  uint64_t pages_read = end_stats.values[STATS_DISK_READS] -
+                        run->start_stats.values[STATS_DISK_READS];
+  uint64_t pages_written = end_stats.values[STATS_DISK_WRITES] -
+                           run->start_stats.values[STATS_DISK_WRITES];
+  uint64_t splits = end_stats.values[STATS_LEAF_SPLITS] + end_stats.values[STATS_INTERNAL_SPLITS] -
+                    run->start_stats.values[STATS_LEAF_SPLITS] -
+                    run->start_stats.values[STATS_INTERNAL_SPLITS];
+
+  qsort(run->latencies, run->done, sizeof(uint64_t), compare_u64);
+  double seconds = run->elapsed_ns / 1e9;
+  double ops_per_sec = seconds > 0 ? run->done / seconds : 0;
+
+  printf("%-12s : %10.0f ops/sec %8u ops", run->name, ops_per_sec, run->done);
+  if (run->bytes && seconds > 0) {
+    printf(" %8.1f MB/s", run->bytes / 1048576.0 / seconds);
+  }
+  printf("\n");
+  printf("%-12s   latency us: p50 %.2f p99 %.2f p999 %.2f max %.2f\n", "",
+         percentile(run->latencies, run->done, 0.50) / 1e3,
+         percentile(run->latencies, run->done, 0.99) / 1e3,
+         percentile(run->latencies, run->done, 0.999) / 1e3,
+         percentile(run->latencies, run->done, 1.0) / 1e3);
+  printf("%-12s   pages read %lu written %lu, splits %lu, file size %ld bytes\n", "",
+         pages_read, pages_written, splits, (long)file_size);
+
+  free(run->latencies);
+}
+
+static DbStatus insert_key(bench_db_t* db, uint64_t key) {
+  row_t row;
+  make_row(&row, key);
+  if (db->sharded != NULL) {
+    return shard_insert(db->sharded, row.id, row.username, row.email);
+  }
+  return libdb_insert(db->db, row.id, row.username, row.email);
+}
+
+static DbStatus get_key(bench_db_t* db, uint64_t key, row_t* row) {
+  if (db->sharded != NULL) {
+    return shard_get(db->sharded, key, row);
+  }
+  return libdb_get(db->db, key, row);
+}
+
+/* Sharded inserts are only queued; this is where their outcome arrives */
+static DbStatus wait_db(bench_db_t* db) {
+  return db->sharded != NULL ? shard_wait(db->sharded) : DB_OK;
+}
+
+static void iter_open(bench_db_t* db, bench_iter_t* iter) {
+  iter->db = db;
+  if (db->sharded != NULL) {
+    shard_iter_open(db->sharded, &(iter->shard_iter));
+  } else {
+    libdb_iter_open(db->db, &(iter->iter));
+  }
+}
+
+static void iter_seek(bench_iter_t* iter, uint32_t start_key) {
+  if (iter->db->sharded != NULL) {
+    shard_iter_seek(&(iter->shard_iter), start_key);
+  } else {
+    libdb_iter_seek(iter->iter, start_key);
+  }
+}
+
+static db_bool iter_valid(bench_iter_t* iter) {
+  return iter->db->sharded != NULL ? shard_iter_valid(&(iter->shard_iter))
+                                   : libdb_iter_valid(iter->iter);
+}
+
+static void iter_row(bench_iter_t* iter, row_view_t* row) {
+  if (iter->db->sharded != NULL) {
+    shard_iter_row(&(iter->shard_iter), row);
+  } else {
+    libdb_iter_row(iter->iter, row);
+  }
+}
+
+static void iter_next(bench_iter_t* iter) {
+  if (iter->db->sharded != NULL) {
+    shard_iter_next(&(iter->shard_iter));
+  } else {
+    libdb_iter_next(iter->iter);
+  }
+}
+
+static void iter_close(bench_iter_t* iter) {
+  if (iter->db->sharded != NULL) {
+    shard_iter_close(&(iter->shard_iter));
+  } else {
+    libdb_iter_close(iter->iter);
+  }
+}
+
+static void open_db(bench_options_t* options, bench_db_t* db) {
+  db->db = NULL;
+  db->sharded = NULL;
+  if (options->shards > 0) {
+    shard_options_t shard_options;
+    shard_options_init(&shard_options);
+    shard_options.num_shards = options->shards;
+    shard_options.mode = options->shard_mode;
+    shard_options.db_options = options->db_options;
+    if (shard_open(options->db_name, &shard_options, &(db->sharded)) != DB_OK) {
+      fprintf(stderr, "Unable to open %s: %s\n", options->db_name, shard_errmsg(db->sharded));
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (libdb_open_with(options->db_name, &(options->db_options), &(db->db)) != DB_OK) {
+    fprintf(stderr, "Unable to open %s: %s\n", options->db_name, libdb_errmsg(db->db));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static DbStatus close_db(bench_db_t* db) {
+  return db->sharded != NULL ? shard_close(db->sharded) : libdb_close(db->db);
+}
+
+static uint64_t table_max_key(table_t* table) {
+  table_lock(table);
+  void* root = get_page(table->pager, table->root_page_num);
+  uint64_t key = 0;
+  if (get_node_kind(root) != NODE_LEAF || *leaf_node_num_cells(root) > 0) {
+    key = get_node_max_key(table->pager, root);
+  }
+  table_unlock(table);
+  return key;
+}
+
+/* Fill benchmarks use keys 1..n, so the max key gives the key range */
+static uint64_t max_key(bench_db_t* db) {
+  if (db->sharded == NULL) {
+    return table_max_key(libdb_table(db->db));
+  }
+
+  shard_wait(db->sharded);
+  uint64_t key = 0;
+  for (uint32_t i = 0; i < shard_count(db->sharded); i++) {
+    uint64_t shard_key = table_max_key(libdb_table(shard_handle(db->sharded, i)));
+    key = shard_key > key ? shard_key : key;
+  }
+  return key;
+}
+
+/* Sum over the shard files and their manifest, or just the db file */
+static off_t db_file_size(bench_options_t* options) {
+  struct stat st;
+  if (options->shards == 0) {
+    return stat(options->db_name, &st) == 0 ? st.st_size : 0;
+  }
+
+  size_t name_len = strlen(options->db_name) + strlen(SHARD_FILE_SUFFIX) + 12;
+  char* filename = malloc(name_len);
+  off_t size = 0;
+  for (uint32_t i = 0; i <= options->shards; i++) {
+    if (i < options->shards) {
+      snprintf(filename, name_len, "%s.%u", options->db_name, i);
+    } else {
+      snprintf(filename, name_len, "%s%s", options->db_name, SHARD_FILE_SUFFIX);
+    }
+    size += stat(filename, &st) == 0 ? st.st_size : 0;
+  }
+  free(filename);
+  return size;
+}
+
+/* fill* start over; a sharded table also drops its layout */
+static void remove_db(bench_options_t* options) {
+  if (options->shards == 0) {
+    unlink(options->db_name);
+    return;
+  }
+
+  size_t name_len = strlen(options->db_name) + strlen(SHARD_FILE_SUFFIX) + 12;
+  char* filename = malloc(name_len);
+  for (uint32_t i = 0; i < SHARD_MAX; i++) {
+    snprintf(filename, name_len, "%s.%u", options->db_name, i);
+    unlink(filename);
+  }
+  snprintf(filename, name_len, "%s%s", options->db_name, SHARD_FILE_SUFFIX);
+  unlink(filename);
+  free(filename);
+}
+
+/*
+Throughput and latency exclude closing the db, but its flush is
+counted in pages written and the file size is taken after it.
+*/
+static void close_and_report(bench_run_t* run, bench_db_t* db, bench_options_t* options) {
+  run->elapsed_ns = now_ns() - run->start_ns;
+  if (close_db(db) != DB_OK) {
+    fprintf(stderr, "%s: error closing db\n", run->name);
+  }
+  run_report(run, db_file_size(options));
+}
+
+static void bench_fill(bench_options_t* options, const char* name, db_bool random) {
+  remove_db(options);
+  bench_db_t db;
+  open_db(options, &db);
+  uint32_t* keys = make_keys(options->num, random);
+
+  bench_run_t run;
+  run_start(&run, name, options->num);
+  for (uint32_t i = 0; i < options->num; i++) {
+    uint64_t start = now_ns();
+    DbStatus status = insert_key(&db, keys[i]);
+    if (status != DB_OK) {
+      fprintf(stderr, "%s: %s after %u rows\n", name, libdb_status_string(status), i);
+      break;
+    }
+    run_op_done(&run, start);
+    run.bytes += ROW_SIZE;
+  }
+  DbStatus status = wait_db(&db);
+  if (status != DB_OK) {
+    fprintf(stderr, "%s: %s\n", name, libdb_status_string(status));
+  }
+
+  free(keys);
+  close_and_report(&run, &db, options);
+}
+
+static void bench_read(bench_options_t* options, const char* name, db_bool missing) {
+  bench_db_t db;
+  open_db(options, &db);
+  uint32_t num_rows = max_key(&db);
+
+  bench_run_t run;
+  run_start(&run, name, options->reads);
+  uint32_t found = 0;
+  row_t row;
+  for (uint32_t i = 0; i < options->reads; i++) {
+    uint64_t key = missing ? num_rows + 1 + rng_next() % (UINT64_MAX - num_rows - 1)
+                           : 1 + rng_uniform(num_rows ? num_rows : 1);
+    uint64_t start = now_ns();
+    found += get_key(&db, key, &row) == DB_OK;
+    run_op_done(&run, start);
+  }
+  printf("%-12s : %u of %u found\n", name, found, options->reads);
+
+  close_and_report(&run, &db, options);
+}
+
+static void bench_scan(bench_options_t* options, const char* name) {
+  bench_db_t db;
+  open_db(options, &db);
+  uint32_t num_rows = max_key(&db);
+
+  bench_run_t run;
+  run_start(&run, name, options->scans);
+  bench_iter_t iter;
+  iter_open(&db, &iter);
+  row_view_t row;
+  for (uint32_t i = 0; i < options->scans; i++) {
+    uint32_t start_key = 1 + rng_uniform(num_rows ? num_rows : 1);
+    uint64_t start = now_ns();
+    iter_seek(&iter, start_key);
+    for (uint32_t n = 0; n < options->scan_length && iter_valid(&iter); n++) {
+      iter_row(&iter, &row);
+      run.bytes += ROW_SIZE;
+      iter_next(&iter);
+    }
+    run_op_done(&run, start);
+  }
+  iter_close(&iter);
+
+  close_and_report(&run, &db, options);
+}
+
+static void bench_mixed(bench_options_t* options, const char* name) {
+  bench_db_t db;
+  open_db(options, &db);
+  uint32_t next_key = max_key(&db) + 1;
+
+  bench_run_t run;
+  run_start(&run, name, options->reads);
+  row_t row;
+  for (uint32_t i = 0; i < options->reads; i++) {
+    uint64_t start = now_ns();
+    if (rng_uniform(100) < options->read_percent) {
+      get_key(&db, 1 + rng_uniform(next_key - 1 ? next_key - 1 : 1), &row);
+    } else if (insert_key(&db, next_key) == DB_OK) {
+      next_key++;
+    }
+    run_op_done(&run, start);
+  }
+  wait_db(&db);
+
+  close_and_report(&run, &db, options);
+}
+
+static db_bool parse_flag(const char* arg, const char* name, const char** value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+    *value = arg + len + 1;
+    return db_true;
+  }
+  return db_false;
+}
+
+static void usage() {
+  printf("usage: db_bench [--benchmarks=%s]\n", DEFAULT_BENCHMARKS);
+  printf("                [--db=%s] [--num=N] [--reads=N] [--scans=N]\n", DEFAULT_BENCH_DB);
+  printf("                [--scan_length=N] [--read_percent=P] [--seed=S]\n");
+  printf("                [--shards=N] [--shard-mode=hash|range] [engine options]\n");
+  printf("engine options:\n");
+  db_options_usage();
+}
+
+int main(int argc, char** argv) {
+  bench_options_t options;
+  options.db_name = DEFAULT_BENCH_DB;
+  options.benchmarks = DEFAULT_BENCHMARKS;
+  options.num = 20000;
+  options.reads = 100000;
+  options.scans = 1000;
+  options.scan_length = 100;
+  options.read_percent = 90;
+  options.seed = 301;
+  options.shards = 0;
+  options.shard_mode = SHARD_BY_HASH;
+  db_options_init(&(options.db_options));
+
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    if (parse_flag(argv[i], "--db", &value)) {
+      options.db_name = value;
+    } else if (parse_flag(argv[i], "--benchmarks", &value)) {
+      options.benchmarks = value;
+    } else if (parse_flag(argv[i], "--num", &value)) {
+      options.num = strtoul(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--reads", &value)) {
+      options.reads = strtoul(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--scans", &value)) {
+      options.scans = strtoul(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--scan_length", &value)) {
+      options.scan_length = strtoul(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--read_percent", &value)) {
+      options.read_percent = strtoul(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--seed", &value)) {
+      options.seed = strtoull(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--shards", &value)) {
+      options.shards = strtoul(value, NULL, 10);
+    } else if (parse_flag(argv[i], "--shard-mode", &value) &&
+               (strcmp(value, "hash") == 0 || strcmp(value, "range") == 0)) {
+      options.shard_mode = strcmp(value, "hash") == 0 ? SHARD_BY_HASH : SHARD_BY_RANGE;
+    } else if (!db_options_parse_flag(&(options.db_options), argv[i])) {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  rng_state = options.seed ? options.seed : 1;
+
+  printf("Rows: %u (%zu bytes each), page size %u, max pages %d\n",
+         options.num, ROW_SIZE, options.db_options.page_size, TABLE_MAX_PAGES);
+
+  char* benchmarks = strdup(options.benchmarks);
+  for (char* name = strtok(benchmarks, ","); name != NULL; name = strtok(NULL, ",")) {
+    if (strcmp(name, "fillseq") == 0) {
+      bench_fill(&options, name, db_false);
+    } else if (strcmp(name, "fillrandom") == 0) {
+      bench_fill(&options, name, db_true);
+    } else if (strcmp(name, "readrandom") == 0) {
+      bench_read(&options, name, db_false);
+    } else if (strcmp(name, "readmissing") == 0) {
+      bench_read(&options, name, db_true);
+    } else if (strcmp(name, "scan") == 0) {
+      bench_scan(&options, name);
+    } else if (strcmp(name, "mixed") == 0) {
+      bench_mixed(&options, name);
+    } else {
+      fprintf(stderr, "Unknown benchmark '%s'\n", name);
+    }
+  }
+  free(benchmarks);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+#include "bloom.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BLOOM_MAGIC 0x314d4c42 /* "BLM1" */
+#define BLOOM_VERSION 2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t clean;
+  uint32_t num_pages;
+  uint64_t num_blocks;
+  uint64_t generation;
+} bloom_header_t;
+
+static uint64_t bloom_size_blocks(uint64_t max_keys) {
+  uint64_t bits = max_keys * BLOOM_BITS_PER_KEY;
+  uint64_t block_bits = BLOOM_BLOCK_WORDS * 64;
+  return (bits + block_bits - 1) / block_bits;
+}
+
+static char* bloom_filename(const char* db_filename) {
+  size_t len = strlen(db_filename) + strlen(BLOOM_FILE_SUFFIX) + 1;
+  char* filename = malloc(len);
+  snprintf(filename, len, "%s%s", db_filename, BLOOM_FILE_SUFFIX);
+  return filename;
+}
+
+bloom_t* bloom_new(uint64_t max_keys) {
+  bloom_t* bloom = malloc(sizeof(bloom_t));
+  bloom->num_blocks = bloom_size_blocks(max_keys);
+  bloom->blocks = calloc(bloom->num_blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+  return bloom;
+}
+
+void bloom_free(bloom_t* bloom) {
+  free(bloom->blocks);
+  free(bloom);
+}
+
+/* splitmix64 finalizer: sequential ids spread over all blocks */
+static uint64_t hash_key(uint64_t key) {
+  uint64_t h = key + 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+/* The high half of the hash picks the block, the low half the bits in it */
+static uint64_t* key_block(bloom_t* bloom, uint64_t hash) {
+  return bloom->blocks + ((hash >> 32) % bloom->num_blocks) * BLOOM_BLOCK_WORDS;
+}
+
+/* Double hashing: probe i is h1 + i * h2 within the 512 bit block */
+#define PROBE_STEP(h1) (((h1) >> 17) | ((h1) << 15) | 1)
+
+void bloom_add(bloom_t* bloom, uint64_t key) {
+  uint64_t hash = hash_key(key);
+  uint64_t* block = key_block(bloom, hash);
+  uint32_t bit = (uint32_t)hash;
+  uint32_t step = PROBE_STEP(bit);
+  for (uint32_t i = 0; i < BLOOM_PROBES; i++, bit += step) {
+    uint32_t index = bit % (BLOOM_BLOCK_WORDS * 64);
+    block[index / 64] |= 1ULL << (index % 64);
+  }
+}
+
+db_bool bloom_may_contain(bloom_t* bloom, uint64_t key) {
+  uint64_t hash = hash_key(key);
+  uint64_t* block = key_block(bloom, hash);
+  uint32_t bit = (uint32_t)hash;
+  uint32_t step = PROBE_STEP(bit);
+  for (uint32_t i = 0; i < BLOOM_PROBES; i++, bit += step) {
+    uint32_t index = bit % (BLOOM_BLOCK_WORDS * 64);
+    if (!(block[index / 64] & (1ULL << (index % 64)))) {
+      return db_false;
+    }
+  }
+  return db_true;
+}
+
+static db_bool read_fully(int fd, void* buf, size_t length) {
+  char* data = buf;
+  while (length > 0) {
+    ssize_t bytes_read = read(fd, data, length);
+    if (bytes_read <= 0) {
+      return db_false;
+    }
+    data += bytes_read;
+    length -= bytes_read;
+  }
+  return db_true;
+}
+
+static db_bool write_fully(int fd, const void* buf, size_t length) {
+  const char* data = buf;
+  while (length > 0) {
+    ssize_t bytes_written = write(fd, data, length);
+    if (bytes_written == -1) {
+      return db_false;
+    }
+    data += bytes_written;
+    length -= bytes_written;
+  }
+  return db_true;
+}
+
+bloom_t* bloom_load(const char* db_filename, uint32_t num_pages, uint64_t generation,
+                    uint64_t max_keys) {
+  char* filename = bloom_filename(db_filename);
+  int fd = open(filename, O_RDONLY);
+  free(filename);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  bloom_header_t header;
+  bloom_t* bloom = NULL;
+  if (read_fully(fd, &header, sizeof(header)) && header.magic == BLOOM_MAGIC &&
+      header.version == BLOOM_VERSION && header.clean && header.num_pages == num_pages &&
+      header.generation == generation && header.num_blocks == bloom_size_blocks(max_keys)) {
+    bloom = bloom_new(max_keys);
+    if (!read_fully(fd, bloom->blocks, bloom->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t))) {
+      bloom_free(bloom);
+      bloom = NULL;
+    }
+  }
+
+  close(fd);
+  return bloom;
+}
+
+/*
+A clean save replaces the file by rename so a crash mid-write cannot
+leave a half written filter marked clean. Marking it open only needs
+the header rewritten in place.
+*/
+void bloom_save(bloom_t* bloom, const char* db_filename, uint32_t num_pages,
+                uint64_t generation, db_bool clean) {
+  char* filename = bloom_filename(db_filename);
+  bloom_header_t header = {
+    BLOOM_MAGIC, BLOOM_VERSION, clean, num_pages, bloom->num_blocks, generation
+  };
+
+  if (!clean) {
+    int fd = open(filename, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR);
+    db_bool ok = fd != -1 && write_fully(fd, &header, sizeof(header)) && fsync(fd) == 0;
+    if (fd != -1) {
+      close(fd);
+    }
+    free(filename);
+    if (!ok) {
+      db_fatal("Unable to write bloom filter file.");
+    }
+    return;
+  }
+
+  size_t tmp_len = strlen(filename) + 5;
+  char* tmp_filename = malloc(tmp_len);
+  snprintf(tmp_filename, tmp_len, "%s.tmp", filename);
+
+  int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  db_bool ok = fd != -1 && write_fully(fd, &header, sizeof(header)) &&
+               write_fully(fd, bloom->blocks,
+                           bloom->num_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t)) &&
+               fsync(fd) == 0;
+  if (fd != -1) {
+    close(fd);
+  }
+  ok = ok && rename(tmp_filename, filename) == 0;
+
+  free(tmp_filename);
+  free(filename);
+  if (!ok) {
+    db_fatal("Unable to write bloom filter file.");
+  }
+}
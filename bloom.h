@@ -0,0 +1,41 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+#include <stdint.h>
+#include "def.h"
+
+// ---------- bloom filter -------------
+/*
+ * Blocked Bloom filter over the primary keys: every key sets its bits
+ * inside one 64 byte block, so a probe costs a single cache miss.
+ * Sized for the most keys the table can hold at about 1% false positives.
+ *
+ * It is kept next to the db as <db>.bloom. The file is marked unclean
+ * while the db is open and clean again by a close that wrote it out;
+ * anything else (missing, unclean, other page count, or saved in an
+ * earlier generation than the last open's) means it is rebuilt from
+ * the table on open.
+ */
+#define BLOOM_FILE_SUFFIX ".bloom"
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_PROBES 7
+
+typedef struct {
+  uint64_t num_blocks;
+  uint64_t* blocks;
+} bloom_t;
+
+bloom_t* bloom_new(uint64_t max_keys);
+void bloom_free(bloom_t* bloom);
+void bloom_add(bloom_t* bloom, uint64_t key);
+/* db_false means the key is definitely absent */
+db_bool bloom_may_contain(bloom_t* bloom, uint64_t key);
+
+/* Filter saved by a clean close of a db of num_pages pages in generation, else NULL */
+bloom_t* bloom_load(const char* db_filename, uint32_t num_pages, uint64_t generation,
+                    uint64_t max_keys);
+/* Write the filter out, marked clean or still open */
+void bloom_save(bloom_t* bloom, const char* db_filename, uint32_t num_pages,
+                uint64_t generation, db_bool clean);
+
+#endif
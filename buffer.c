@@ -1,4 +1,5 @@
 #include "buffer.h"
+#include <stdlib.h>
 
 buf_t* new_buf() {
   buf_t* buf = (buf_t*) malloc(sizeof(buf_t));
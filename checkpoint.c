@@ -0,0 +1,226 @@
+#include "checkpoint.h"
+#include "stats.h"
+#include "warm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct __checkpoint {
+  table_t* table;
+  uint32_t interval_ms;
+  double dirty_ratio;
+  /* Compaction swaps the pager but keeps its page size */
+  uint32_t page_size;
+  /* Aligned for O_DIRECT: one frame per staged page */
+  void* staging;
+  page_write_t writes[CHECKPOINT_BATCH_PAGES + 1];
+  warm_set_t warm_set;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  /* A staged batch is on its way to the file; set under the table lock */
+  db_bool writing;
+  pthread_cond_t idle;
+  db_bool stopping;
+  db_bool failed;
+};
+
+static db_bool over_dirty_ratio(checkpoint_t* checkpoint) {
+  page_t* pager = checkpoint->table->pager;
+  return pager->num_dirty > 0 &&
+         pager->num_dirty >= checkpoint->dirty_ratio * pager->num_pages;
+}
+
+static void set_writing(checkpoint_t* checkpoint, db_bool writing) {
+  pthread_mutex_lock(&(checkpoint->lock));
+  checkpoint->writing = writing;
+  if (!writing) {
+    pthread_cond_broadcast(&(checkpoint->idle));
+  }
+  pthread_mutex_unlock(&(checkpoint->lock));
+}
+
+/* The resident set changes slowly; refreshing it once per sweep is plenty */
+static void checkpoint_save_warm(checkpoint_t* checkpoint) {
+  table_t* table = checkpoint->table;
+  table_lock(table);
+  if (!table->pager->options.warm_restart) {
+    table_unlock(table);
+    return;
+  }
+  warm_snapshot(table->pager, &(checkpoint->warm_set));
+  char* filename = strdup(table->pager->filename);
+  table_unlock(table);
+
+  warm_save(filename, &(checkpoint->warm_set));
+  free(filename);
+}
+
+/*
+The write goes through a dup of the pager's descriptor so that a
+compaction swapping the pager mid-write cannot close it under us; the
+pages it copied from the old pager are in the new file anyway.
+On an error the batch is marked dirty again and left for db_close,
+which reports it.
+*/
+static void checkpoint_sweep(checkpoint_t* checkpoint) {
+  table_t* table = checkpoint->table;
+
+  table_lock(table);
+  db_bool run = over_dirty_ratio(checkpoint);
+  table_unlock(table);
+  if (!run) {
+    return;
+  }
+
+  STATS_INC(STATS_CHECKPOINTS);
+  uint32_t next_page_num = 0;
+  while (1) {
+    table_lock(table);
+    page_t* pager = table->pager;
+    uint32_t count = page_stage_dirty(pager, next_page_num, CHECKPOINT_BATCH_PAGES,
+                                      checkpoint->staging, checkpoint->writes);
+    int fd = count > 0 ? dup(pager->file_descriptor) : -1;
+    if (count > 0) {
+      set_writing(checkpoint, db_true);
+    }
+    table_unlock(table);
+
+    if (count == 0) {
+      checkpoint_save_warm(checkpoint);
+      return;
+    }
+
+    db_bool ok = fd != -1 && page_write_staged(fd, checkpoint->staging, checkpoint->writes, count);
+    if (fd != -1) {
+      close(fd);
+    }
+
+    if (!ok) {
+      table_lock(table);
+      if (table->pager == pager) {
+        for (uint32_t i = 0; i < count; i++) {
+          if (checkpoint->writes[i].page_num != PAGE_MAP_WRITE) {
+            page_mark_dirty(pager, checkpoint->writes[i].page_num);
+          }
+        }
+      }
+      table_unlock(table);
+      set_writing(checkpoint, db_false);
+      checkpoint->failed = db_true;
+      return;
+    }
+    set_writing(checkpoint, db_false);
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (checkpoint->writes[i].page_num != PAGE_MAP_WRITE) {
+        next_page_num = checkpoint->writes[i].page_num + 1;
+      }
+    }
+  }
+}
+
+static void* checkpoint_main(void* arg) {
+  checkpoint_t* checkpoint = arg;
+
+  pthread_mutex_lock(&(checkpoint->lock));
+  while (!checkpoint->stopping && !checkpoint->failed) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t nsec = deadline.tv_nsec + (uint64_t)checkpoint->interval_ms * 1000000ULL;
+    deadline.tv_sec += nsec / 1000000000ULL;
+    deadline.tv_nsec = nsec % 1000000000ULL;
+
+    int result = 0;
+    while (!checkpoint->stopping && result != ETIMEDOUT) {
+      result = pthread_cond_timedwait(&(checkpoint->wake), &(checkpoint->lock), &deadline);
+    }
+    if (checkpoint->stopping) {
+      break;
+    }
+
+    pthread_mutex_unlock(&(checkpoint->lock));
+    checkpoint_sweep(checkpoint);
+    pthread_mutex_lock(&(checkpoint->lock));
+  }
+  pthread_mutex_unlock(&(checkpoint->lock));
+
+  return NULL;
+}
+
+checkpoint_t* checkpoint_start(table_t* table, uint32_t interval_ms, double dirty_ratio) {
+  checkpoint_t* checkpoint = calloc(1, sizeof(checkpoint_t));
+  checkpoint->table = table;
+  checkpoint->interval_ms = interval_ms;
+  checkpoint->dirty_ratio = dirty_ratio;
+  checkpoint->page_size = table->pager->page_size;
+
+  checkpoint->staging = mmap(NULL, PAGE_STAGING_SIZE(checkpoint->page_size, CHECKPOINT_BATCH_PAGES),
+                             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (checkpoint->staging == MAP_FAILED) {
+    free(checkpoint);
+    return NULL;
+  }
+
+  pthread_mutex_init(&(checkpoint->lock), NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&(checkpoint->wake), &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&(checkpoint->idle), NULL);
+
+  if (pthread_create(&(checkpoint->thread), NULL, checkpoint_main, checkpoint) != 0) {
+    pthread_cond_destroy(&(checkpoint->wake));
+    pthread_cond_destroy(&(checkpoint->idle));
+    pthread_mutex_destroy(&(checkpoint->lock));
+    munmap(checkpoint->staging, PAGE_STAGING_SIZE(checkpoint->page_size, CHECKPOINT_BATCH_PAGES));
+    free(checkpoint);
+    return NULL;
+  }
+
+  return checkpoint;
+}
+
+void checkpoint_stop(checkpoint_t* checkpoint) {
+  pthread_mutex_lock(&(checkpoint->lock));
+  checkpoint->stopping = db_true;
+  pthread_cond_signal(&(checkpoint->wake));
+  pthread_mutex_unlock(&(checkpoint->lock));
+
+  pthread_join(checkpoint->thread, NULL);
+
+  pthread_cond_destroy(&(checkpoint->wake));
+  pthread_cond_destroy(&(checkpoint->idle));
+  pthread_mutex_destroy(&(checkpoint->lock));
+  munmap(checkpoint->staging, PAGE_STAGING_SIZE(checkpoint->page_size, CHECKPOINT_BATCH_PAGES));
+  free(checkpoint);
+}
+
+/*
+writing is only set with the table lock held, so once it is seen clear
+under the lock no batch can start until the lock is released.
+*/
+void checkpoint_lock_idle(checkpoint_t* checkpoint) {
+  while (1) {
+    pthread_mutex_lock(&(checkpoint->lock));
+    while (checkpoint->writing) {
+      pthread_cond_wait(&(checkpoint->idle), &(checkpoint->lock));
+    }
+    pthread_mutex_unlock(&(checkpoint->lock));
+
+    table_lock(checkpoint->table);
+    pthread_mutex_lock(&(checkpoint->lock));
+    db_bool writing = checkpoint->writing;
+    pthread_mutex_unlock(&(checkpoint->lock));
+    if (!writing) {
+      return;
+    }
+    table_unlock(checkpoint->table);
+  }
+}
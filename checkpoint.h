@@ -0,0 +1,23 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+#include <stdint.h>
+#include "table.h"
+
+// ---------- checkpointer -------------
+/*
+ * Background writer. Every interval it checks the share of dirty pages
+ * and, past the configured ratio, sweeps the file once in page order:
+ * a batch of dirty pages is copied out under the table lock, then
+ * written with the lock released so the foreground keeps running.
+ */
+#define CHECKPOINT_BATCH_PAGES 256
+
+typedef struct __checkpoint checkpoint_t;
+
+checkpoint_t* checkpoint_start(table_t* table, uint32_t interval_ms, double dirty_ratio);
+/* Wait for an in-flight sweep and stop the thread */
+void checkpoint_stop(checkpoint_t* checkpoint);
+/* Take the table lock with no staged batch still to reach the file */
+void checkpoint_lock_idle(checkpoint_t* checkpoint);
+
+#endif
@@ -0,0 +1,531 @@
+#include "compact.h"
+#include "error.h"
+#include "tree.h"
+#include "header.h"
+#include "warm.h"
+#include "backup.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct {
+  uint32_t page_num;
+  uint64_t max_key;
+} compact_child_t;
+
+/* Deeper than any tree TABLE_MAX_PAGES pages can hold */
+#define V1_MAX_DEPTH 32
+
+/*
+Rows to rewrite, in key order: the open table through a cursor, or a
+format 1 or legacy file being upgraded, walked from its root. Their
+leaf chains are not trusted: legacy files end them with
+INVALID_PAGE_NUM rather than 0.
+*/
+typedef struct {
+  db_bool from_table;
+  cursor_t cursor;
+  page_t* pager;
+  /* Internal nodes from the root down, and the next child of each */
+  uint32_t depth;
+  uint32_t path[V1_MAX_DEPTH];
+  uint32_t next_child[V1_MAX_DEPTH];
+  uint32_t leaves_seen;
+  uint32_t page_num;
+  uint32_t cell_num;
+  db_bool started;
+  uint32_t last_key;
+  db_bool end;
+  db_bool corrupt;
+} compact_source_t;
+
+/*
+ * Format 1 layout, as written before keys and ids were 64 bit: the
+ * same node headers without the internal key frame, 32 bit keys, and
+ * a 32 bit id at the front of the row.
+ */
+#define V1_INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + \
+                                      INTERNAL_NODE_NUM_KEYS_SIZE + \
+                                      INTERNAL_NODE_RIGHT_CHILD_SIZE)
+#define V1_INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + sizeof(uint32_t))
+#define V1_KEY_SIZE sizeof(uint32_t)
+#define V1_ROW_SIZE (sizeof(uint32_t) + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+#define V1_LEAF_NODE_CELL_SIZE (V1_KEY_SIZE + V1_ROW_SIZE)
+
+static uint32_t div_ceil(uint32_t a, uint32_t b) {
+  return (a + b - 1) / b;
+}
+
+static void* v1_leaf_cell(void* node, uint32_t cell_num) {
+  return (char*)node + LEAF_NODE_HEADER_SIZE + (size_t)cell_num * V1_LEAF_NODE_CELL_SIZE;
+}
+
+static uint32_t v1_num_keys(void* node) {
+  return *(uint32_t*)((char*)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+/* Child i of an internal node; i == num_keys is the right child */
+static uint32_t v1_child(void* node, uint32_t i) {
+  char* header = node;
+  if (i == v1_num_keys(node)) {
+    return *(uint32_t*)(header + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+  }
+  return *(uint32_t*)(header + V1_INTERNAL_NODE_HEADER_SIZE +
+                      (size_t)i * V1_INTERNAL_NODE_CELL_SIZE);
+}
+
+static void v1_corrupt(compact_source_t* source) {
+  source->corrupt = db_true;
+  source->end = db_true;
+}
+
+/*
+Descend into page_num, which must be a page of the file and a node
+that fits in it. Internal nodes are pushed; db_true once on a leaf, or
+when the file turned out corrupt.
+*/
+static db_bool v1_enter(compact_source_t* source, uint32_t page_num) {
+  page_t* pager = source->pager;
+  if (page_num >= pager->num_pages) {
+    v1_corrupt(source);
+    return db_true;
+  }
+
+  void* node = get_page(pager, page_num);
+  uint32_t page_size = pager->page_size;
+  if (get_node_kind(node) == NODE_INTERNAL) {
+    uint32_t max_keys = (page_size - V1_INTERNAL_NODE_HEADER_SIZE) / V1_INTERNAL_NODE_CELL_SIZE;
+    if (source->depth == V1_MAX_DEPTH || v1_num_keys(node) > max_keys) {
+      v1_corrupt(source);
+      return db_true;
+    }
+    source->path[source->depth] = page_num;
+    source->next_child[source->depth] = 0;
+    source->depth++;
+    return db_false;
+  }
+
+  if (get_node_kind(node) != NODE_LEAF || ++source->leaves_seen > pager->num_pages ||
+      *leaf_node_num_cells(node) > (page_size - LEAF_NODE_HEADER_SIZE) / V1_LEAF_NODE_CELL_SIZE) {
+    v1_corrupt(source);
+    return db_true;
+  }
+  source->page_num = page_num;
+  source->cell_num = 0;
+  return db_true;
+}
+
+/* The next leaf in key order, or the end */
+static void v1_next_leaf(compact_source_t* source) {
+  while (source->depth > 0) {
+    uint32_t level = source->depth - 1;
+    void* node = get_page(source->pager, source->path[level]);
+    if (source->next_child[level] > v1_num_keys(node)) {
+      source->depth--;
+      continue;
+    }
+    uint32_t page_num = v1_child(node, source->next_child[level]++);
+    /* A right child legacy files never filled in */
+    if (page_num == INVALID_PAGE_NUM) {
+      continue;
+    }
+    if (page_num == 0) {
+      v1_corrupt(source);
+      return;
+    }
+    if (v1_enter(source, page_num)) {
+      return;
+    }
+  }
+  source->end = db_true;
+}
+
+/* Skip over empty leaves, and stop at keys out of order */
+static void v1_settle(compact_source_t* source) {
+  void* node = get_page(source->pager, source->page_num);
+  while (source->cell_num >= *leaf_node_num_cells(node)) {
+    v1_next_leaf(source);
+    if (source->end) {
+      return;
+    }
+    node = get_page(source->pager, source->page_num);
+  }
+
+  uint32_t key = *(uint32_t*)v1_leaf_cell(node, source->cell_num);
+  if (source->started && key <= source->last_key) {
+    v1_corrupt(source);
+    return;
+  }
+  source->started = db_true;
+  source->last_key = key;
+}
+
+static void source_start_v1(compact_source_t* source, page_t* pager, uint32_t root_page_num) {
+  memset(source, 0, sizeof(compact_source_t));
+  source->pager = pager;
+  if (!v1_enter(source, root_page_num)) {
+    v1_next_leaf(source);
+  }
+  if (!source->end) {
+    v1_settle(source);
+  }
+}
+
+static void source_start_table(compact_source_t* source, table_t* table) {
+  source->from_table = db_true;
+  table_start(table, &(source->cursor));
+}
+
+static db_bool source_end(compact_source_t* source) {
+  return source->from_table ? source->cursor.end_of_table : source->end;
+}
+
+/* Write the current row into cell cell_num of leaf */
+static void source_copy(compact_source_t* source, void* leaf, uint32_t cell_num) {
+  if (source->from_table) {
+    *leaf_node_key(leaf, cell_num) = cursor_key(&(source->cursor));
+    memcpy(leaf_node_value(leaf, cell_num), cursor_value(&(source->cursor)),
+           LEAF_NODE_VALUE_SIZE);
+    return;
+  }
+
+  char* cell = v1_leaf_cell(get_page(source->pager, source->page_num), source->cell_num);
+  char* value = leaf_node_value(leaf, cell_num);
+  uint32_t id;
+  memcpy(&id, cell + V1_KEY_SIZE, sizeof(uint32_t));
+  *leaf_node_key(leaf, cell_num) = *(uint32_t*)cell;
+  memset(value, 0, LEAF_NODE_VALUE_SIZE);
+  *(uint64_t*)(value + ID_OFFSET) = id;
+  memcpy(value + USERNAME_OFFSET, cell + V1_KEY_SIZE + sizeof(uint32_t),
+         COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE);
+}
+
+static void source_advance(compact_source_t* source) {
+  if (source->from_table) {
+    cursor_advance(&(source->cursor));
+    return;
+  }
+  source->cell_num++;
+  v1_settle(source);
+}
+
+static uint32_t count_rows(compact_source_t* source) {
+  uint32_t num_rows = 0;
+  while (!source_end(source)) {
+    num_rows++;
+    source_advance(source);
+  }
+  return num_rows;
+}
+
+static void* get_clean_page(page_t* pager, uint32_t page_num) {
+  void* page = get_page_for_write(pager, page_num);
+  memset(page, 0, pager->page_size);
+  return page;
+}
+
+static db_bool key_fits(uint64_t base, uint64_t key) {
+  return key - base <= INTERNAL_NODE_MAX_DELTA;
+}
+
+/*
+Children [begin, return value) go under one parent. A parent stores
+every child's max key but the last's, relative to the lower fence
+(children[begin - 1].max_key, or 0 for the first parent). It takes
+up to narrow_fanout children while those keys fit the 32 bit frame,
+and becomes wide when that would take fewer than wide_fanout.
+*/
+static uint32_t group_end(compact_child_t* children, uint32_t begin, uint32_t level_size,
+                          uint32_t narrow_fanout, uint32_t wide_fanout, db_bool* wide) {
+  uint64_t base = begin == 0 ? 0 : children[begin - 1].max_key;
+  uint32_t end = begin + 1;
+  while (end < level_size && end - begin < narrow_fanout &&
+         key_fits(base, children[end - 1].max_key)) {
+    end++;
+  }
+  uint32_t wide_end = begin + wide_fanout < level_size ? begin + wide_fanout : level_size;
+  *wide = end < wide_end;
+  return *wide ? wide_end : end;
+}
+
+/*
+Split one level into parents. The last parent never gets a lone
+child: it takes one from its neighbour, or the neighbour keeps it.
+Returns the number of parents.
+*/
+static uint32_t level_groups(compact_child_t* children, uint32_t level_size,
+                             uint32_t narrow_fanout, uint32_t wide_fanout,
+                             uint32_t* ends, db_bool* wide) {
+  uint32_t num_groups = 0;
+  uint32_t begin = 0;
+  while (begin < level_size) {
+    uint32_t end = group_end(children, begin, level_size, narrow_fanout, wide_fanout,
+                             &wide[num_groups]);
+    if (end + 1 == level_size) {
+      if (end - begin > 2) {
+        end--;
+      } else {
+        /* Two children and the lone one; wide always has room for three */
+        end++;
+        wide[num_groups] = wide[num_groups] ||
+                           !key_fits(begin == 0 ? 0 : children[begin - 1].max_key,
+                                     children[end - 2].max_key);
+      }
+    }
+    ends[num_groups++] = end;
+    begin = end;
+  }
+  return num_groups;
+}
+
+static void sync_parent_dir(const char* filename) {
+  char* path = strdup(filename);
+  int fd = open(dirname(path), O_RDONLY);
+  free(path);
+  if (fd == -1) {
+    return;
+  }
+  fsync(fd);
+  close(fd);
+}
+
+/*
+Write the rows of source into a fresh file at filename: header at
+page 0, root at page 1, then the leaves, then every other internal
+level. The header carries generation. The file is flushed and synced;
+*out is its pager.
+*/
+static CompactResult compact_build(compact_source_t* source, uint32_t num_rows,
+                                   const char* filename, const db_options_t* options,
+                                   uint32_t page_size, db_bool compressed, double fill_factor,
+                                   uint64_t generation, page_t** out) {
+  uint32_t leaf_fill = (uint32_t)(LEAF_NODE_MAX_CELLS(page_size) * fill_factor);
+  if (leaf_fill < 1) {
+    leaf_fill = 1;
+  }
+  uint32_t narrow_fanout = (uint32_t)((INTERNAL_NODE_MAX_CELLS(page_size) + 1) * fill_factor);
+  uint32_t wide_fanout = (uint32_t)((INTERNAL_NODE_WIDE_MAX_CELLS(page_size) + 1) * fill_factor);
+  if (narrow_fanout < 2) {
+    narrow_fanout = 2;
+  }
+  if (wide_fanout < 2) {
+    wide_fanout = 2;
+  }
+
+  uint32_t num_leaves = num_rows == 0 ? 1 : div_ceil(num_rows, leaf_fill);
+
+  /* Every parent has at least wide_fanout children but the last */
+  uint32_t root_page_num = DB_HEADER_PAGE_NUM + 1;
+  uint32_t total_pages = 2;
+  if (num_leaves > 1) {
+    total_pages += num_leaves;
+    for (uint32_t level = div_ceil(num_leaves, wide_fanout); level > 1;) {
+      total_pages += level;
+      level = div_ceil(level, wide_fanout);
+    }
+  }
+  if (total_pages > TABLE_MAX_PAGES) {
+    return COMPACT_TABLE_FULL;
+  }
+
+  unlink(filename);
+  page_t* pager = page_open(filename, options, page_size, compressed);
+  compact_child_t* children = malloc(num_leaves * sizeof(compact_child_t));
+  uint32_t* ends = malloc(num_leaves * sizeof(uint32_t));
+  db_bool* wide = malloc(num_leaves * sizeof(db_bool));
+
+  /* A failed read or write leaves neither the copy nor its pager behind */
+  db_error_trap_t trap;
+  db_error_push(&trap);
+  if (setjmp(trap.env) != 0) {
+    free(wide);
+    free(ends);
+    free(children);
+    page_discard(pager);
+    unlink(filename);
+    db_fatal("%s", trap.message);
+  }
+
+  db_header_t header = {DB_HEADER_MAGIC, DB_FORMAT_VERSION, page_size, root_page_num,
+                        compressed ? DB_HEADER_COMPRESSED : 0, generation};
+  header_store(pager, &header);
+
+  /* Stream rows in key order into contiguous, packed leaves */
+  for (uint32_t i = 0; i < num_leaves; i++) {
+    uint32_t page_num = num_leaves == 1 ? root_page_num : root_page_num + 1 + i;
+    void* leaf = get_clean_page(pager, page_num);
+    initialize_leaf_node(leaf);
+
+    uint32_t num_cells = 0;
+    while (num_cells < leaf_fill && !source_end(source)) {
+      source_copy(source, leaf, num_cells);
+      num_cells++;
+      source_advance(source);
+    }
+
+    *leaf_node_num_cells(leaf) = num_cells;
+    *leaf_node_next_leaf(leaf) = i + 1 < num_leaves ? page_num + 1 : 0;
+    children[i].page_num = page_num;
+    children[i].max_key = num_cells == 0 ? 0 : *leaf_node_key(leaf, num_cells - 1);
+  }
+
+  /* Build internal levels bottom-up. The last level becomes the root. */
+  uint32_t next_page_num = root_page_num + 1 + num_leaves;
+  uint32_t level_size = num_leaves;
+  while (level_size > 1) {
+    uint32_t num_parents = level_groups(children, level_size, narrow_fanout, wide_fanout,
+                                        ends, wide);
+
+    uint32_t begin = 0;
+    for (uint32_t p = 0; p < num_parents; p++) {
+      uint32_t end = ends[p];
+      uint32_t page_num = num_parents == 1 ? root_page_num : next_page_num++;
+
+      void* node = get_clean_page(pager, page_num);
+      initialize_internal_node(node);
+      internal_node_set_frame(node, begin == 0 ? 0 : children[begin - 1].max_key, wide[p]);
+      *internal_node_num_keys(node) = end - begin - 1;
+
+      for (uint32_t c = begin; c < end; c++) {
+        if (c + 1 < end) {
+          *internal_node_cell(node, c - begin) = children[c].page_num;
+          internal_node_set_key(node, c - begin, children[c].max_key);
+        } else {
+          *internal_node_right_child(node) = children[c].page_num;
+        }
+        *node_parent(get_page_for_write(pager, children[c].page_num)) = page_num;
+      }
+
+      children[p].page_num = page_num;
+      children[p].max_key = children[end - 1].max_key;
+      begin = end;
+    }
+
+    level_size = num_parents;
+  }
+
+  void* root = get_page_for_write(pager, root_page_num);
+  set_node_root(root, db_true);
+  *node_parent(root) = 0;
+
+  page_flush_dirty(pager);
+  if (fsync(pager->file_descriptor) == -1) {
+    db_fatal("Error syncing compacted file.");
+  }
+  db_error_pop(&trap);
+  free(wide);
+  free(ends);
+  free(children);
+  *out = pager;
+  return COMPACT_SUCCESS;
+}
+
+static char* compact_filename(const char* db_filename) {
+  size_t name_len = strlen(db_filename) + strlen(COMPACT_FILE_SUFFIX) + 1;
+  char* tmp_filename = malloc(name_len);
+  snprintf(tmp_filename, name_len, "%s%s", db_filename, COMPACT_FILE_SUFFIX);
+  return tmp_filename;
+}
+
+CompactResult table_compact(table_t* table, double fill_factor) {
+  if (!(fill_factor > 0 && fill_factor <= 1)) {
+    return COMPACT_INVALID_FILL_FACTOR;
+  }
+
+  /* Buffered rows are included */
+  compact_source_t source;
+  source_start_table(&source, table);
+  uint32_t num_rows = count_rows(&source);
+  source_start_table(&source, table);
+
+  char* tmp_filename = compact_filename(table->pager->filename);
+  page_t* pager;
+  CompactResult result = compact_build(&source, num_rows, tmp_filename,
+                                       &(table->pager->options), table->pager->page_size,
+                                       table->pager->compressed, fill_factor,
+                                       table->generation, &pager);
+  if (result != COMPACT_SUCCESS) {
+    free(tmp_filename);
+    return result;
+  }
+
+  /* Atomically replace the old file, then swap the pager in place */
+  if (rename(tmp_filename, table->pager->filename) == -1) {
+    db_fatal("Error replacing db file with compacted copy.");
+  }
+  sync_parent_dir(table->pager->filename);
+
+  free(pager->filename);
+  pager->filename = strdup(table->pager->filename);
+  free(tmp_filename);
+
+  /* The prefetcher's page numbers mean nothing in the new layout */
+  if (table->warm != NULL) {
+    warm_cancel(table->warm);
+  }
+  /* Nor are a running backup's */
+  if (table->backup != NULL) {
+    backup_cancel(table->backup);
+  }
+  page_discard(table->pager);
+  table->pager = pager;
+  table->root_page_num = DB_HEADER_PAGE_NUM + 1;
+  if (table->memtable != NULL) {
+    memtable_clear(table->memtable);
+  }
+  if (table->hash_index != NULL) {
+    table_rebuild_hash_index(table);
+  }
+
+  return COMPACT_SUCCESS;
+}
+
+CompactResult compact_upgrade(const char* filename, const db_header_t* header,
+                              const db_options_t* options) {
+  db_bool compressed = (header->flags & DB_HEADER_COMPRESSED) != 0;
+  page_t* old_pager = page_open(filename, options, header->page_size, compressed);
+  char* tmp_filename = compact_filename(filename);
+
+  /* compact_build() cleans up after itself; the old file's pager is ours */
+  db_error_trap_t trap;
+  db_error_push(&trap);
+  if (setjmp(trap.env) != 0) {
+    page_discard(old_pager);
+    free(tmp_filename);
+    db_fatal("%s", trap.message);
+  }
+
+  compact_source_t source;
+  source_start_v1(&source, old_pager, header->root_page_num);
+  uint32_t num_rows = count_rows(&source);
+  if (source.corrupt) {
+    db_error_pop(&trap);
+    page_discard(old_pager);
+    free(tmp_filename);
+    return COMPACT_CORRUPT;
+  }
+  source_start_v1(&source, old_pager, header->root_page_num);
+
+  page_t* pager;
+  CompactResult result = compact_build(&source, num_rows, tmp_filename, options,
+                                       header->page_size, compressed, 1.0, 0, &pager);
+  db_error_pop(&trap);
+  page_discard(old_pager);
+  if (result != COMPACT_SUCCESS) {
+    unlink(tmp_filename);
+    free(tmp_filename);
+    return result;
+  }
+  page_close(pager);
+
+  if (rename(tmp_filename, filename) == -1) {
+    db_fatal("Error replacing db file with upgraded copy.");
+  }
+  sync_parent_dir(filename);
+  free(tmp_filename);
+  return COMPACT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+#include "table.h"
+#include "header.h"
+
+// ---------- compaction -------------
+#define COMPACT_DEFAULT_FILL_FACTOR 1.0
+#define COMPACT_FILE_SUFFIX ".compact"
+
+typedef enum {
+  COMPACT_SUCCESS,
+  COMPACT_INVALID_FILL_FACTOR,
+  COMPACT_TABLE_FULL,
+  /* compact_upgrade() only: the old file is not a tree it can walk */
+  COMPACT_CORRUPT
+} CompactResult;
+
+/*
+ * Rewrite the table into a fresh file and swap it in: the header at
+ * page 0, the root at page 1, leaves contiguous in key order right
+ * after it, then the remaining internal nodes grouped at the end.
+ * Leaves and internal nodes are packed to fill_factor (0, 1].
+ * Rows in the write buffer are written out too and the buffer emptied.
+ */
+CompactResult table_compact(table_t* table, double fill_factor);
+
+/*
+ * Rewrite a legacy or format 1 file, described by header, in the
+ * current format, packed full. Called by db_open() before the file
+ * is opened for use.
+ */
+CompactResult compact_upgrade(const char* filename, const db_header_t* header,
+                              const db_options_t* options);
+
+#endif
@@ -1,30 +1,215 @@
 #include "db.h"
 #include "tree.h"
+#include "compact.h"
+#include "import.h"
+#include "checkpoint.h"
+#include "warm.h"
+#include "backup.h"
+#include "header.h"
+#include "result.h"
+#include "stats.h"
+#include "error.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 
-MetaCommandResult do_meta_command(buf_t* buf, table_t* table) {
-  if(strcmp(buf->buf, ".exit") == 0) {
-    db_close(table);
-    exit(EXIT_SUCCESS);
+static result_writer_t* result_writer = NULL;
+
+static result_writer_t* get_result_writer() {
+  if (result_writer == NULL) {
+    result_writer = new_result_writer(stdout, OUTPUT_TEXT);
+  }
+  return result_writer;
+}
+
+#define STATEMENT_KIND_COUNT (STATEMENT_SELECT + 1)
+
+static const char* statement_kind_names[STATEMENT_KIND_COUNT] = { "insert", "select" };
+static stats_histogram_t prepare_latency;
+static stats_histogram_t statement_latency[STATEMENT_KIND_COUNT];
+
+static void print_stats(table_t* table, db_bool json) {
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+  uint32_t depth = get_tree_depth(table->pager, table->root_page_num);
+
+  if (json) {
+    printf("{\"counters\":{");
+    for (uint32_t i = 0; i < STATS_COUNTER_COUNT; i++) {
+      printf("%s\"%s\":%lu", i ? "," : "", stats_counter_name(i), snapshot.values[i]);
+    }
+    printf("},\"tree_depth\":%u,\"num_pages\":%u,\"latency\":{", depth,
+           table->pager->num_pages);
+    stats_histogram_print(stdout, "prepare", &prepare_latency, db_true);
+    for (uint32_t i = 0; i < STATEMENT_KIND_COUNT; i++) {
+      printf(",");
+      stats_histogram_print(stdout, statement_kind_names[i], &statement_latency[i], db_true);
+    }
+    printf("}}\n");
+    return;
+  }
+
+  printf("Stats:\n");
+  for (uint32_t i = 0; i < STATS_COUNTER_COUNT; i++) {
+    printf("%-16s %lu\n", stats_counter_name(i), snapshot.values[i]);
   }
-  else if (strcmp(buf->buf, ".constants") == 0) {
+  printf("%-16s %u\n", "tree_depth", depth);
+  printf("%-16s %u\n", "num_pages", table->pager->num_pages);
+  printf("Latency:\n");
+  stats_histogram_print(stdout, "prepare", &prepare_latency, db_false);
+  for (uint32_t i = 0; i < STATEMENT_KIND_COUNT; i++) {
+    stats_histogram_print(stdout, statement_kind_names[i], &statement_latency[i], db_false);
+  }
+}
+
+MetaCommandResult do_meta_command(buf_t* buf, table_t* table) {
+  if (strcmp(buf->buf, ".constants") == 0) {
     printf("Constants:\n");
-    print_constants();
+    print_constants(table->pager);
     return META_COMMAND_SUCCESS;
   }
   else if (strcmp(buf->buf, ".btree") == 0) {
     printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
+    print_tree(table->pager, table->root_page_num, 0);
     return META_COMMAND_SUCCESS;
   } 
+  else if (strcmp(buf->buf, ".stats") == 0) {
+    print_stats(table, db_false);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(buf->buf, ".stats json") == 0) {
+    print_stats(table, db_true);
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(buf->buf, ".stats reset") == 0) {
+    stats_reset();
+    stats_histogram_reset(&prepare_latency);
+    for (uint32_t i = 0; i < STATEMENT_KIND_COUNT; i++) {
+      stats_histogram_reset(&statement_latency[i]);
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(buf->buf, ".output text") == 0) {
+    get_result_writer()->format = OUTPUT_TEXT;
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(buf->buf, ".output binary") == 0) {
+    get_result_writer()->format = OUTPUT_BINARY;
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(buf->buf, ".compact", 8) == 0 &&
+           (buf->buf[8] == '\0' || buf->buf[8] == ' ')) {
+    double fill_factor = COMPACT_DEFAULT_FILL_FACTOR;
+    if (buf->buf[8] == ' ') {
+      fill_factor = atof(buf->buf + 9);
+    }
+
+    uint32_t old_num_pages = table->pager->num_pages;
+    switch (table_compact(table, fill_factor)) {
+      case COMPACT_SUCCESS:
+        printf("Compacted %d pages into %d.\n", old_num_pages, table->pager->num_pages);
+        break;
+      case COMPACT_INVALID_FILL_FACTOR:
+        printf("Fill factor must be in (0, 1].\n");
+        break;
+      case COMPACT_TABLE_FULL:
+        printf("Error: Table full.\n");
+        break;
+      case COMPACT_CORRUPT:
+        printf("Error: Table is corrupt.\n");
+        break;
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(buf->buf, ".import ", 8) == 0) {
+    const char* filename = buf->buf + 8;
+    import_report_t report;
+    switch (table_import(table, filename, &report)) {
+      case IMPORT_SUCCESS:
+        printf("Imported %lu rows, %lu duplicates skipped.\n", report.rows, report.duplicates);
+        break;
+      case IMPORT_CANNOT_OPEN:
+        printf("Unable to read %s.\n", filename);
+        break;
+      case IMPORT_INVALID_LINE:
+        printf("Error: %s line %lu: %s. Nothing imported.\n", filename, report.line,
+               report.reason);
+        break;
+      case IMPORT_TABLE_FULL:
+        printf("Error: Table full after importing %lu rows.\n", report.rows);
+        break;
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strncmp(buf->buf, ".backup ", 8) == 0) {
+    const char* path = buf->buf + 8;
+    switch (table_backup(table, path)) {
+      case BACKUP_STARTED:
+        printf("Backup to %s started.\n", path);
+        break;
+      case BACKUP_ALREADY_RUNNING:
+        printf("A backup is already running.\n");
+        break;
+      case BACKUP_CANNOT_CREATE:
+        printf("Unable to create %s%s.\n", path, BACKUP_TMP_SUFFIX);
+        break;
+      case BACKUP_SAME_FILE:
+        printf("Cannot back up the db onto itself.\n");
+        break;
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  else if (strcmp(buf->buf, ".backup") == 0) {
+    backup_report_t report;
+    if (!table_backup_status(table, &report)) {
+      printf("No backup has been started.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    switch (report.state) {
+      case BACKUP_RUNNING:
+        printf("Backup to %s: %u of %u pages copied.\n", report.path, report.pages_done,
+               report.num_pages);
+        break;
+      case BACKUP_DONE:
+        printf("Backup to %s done: %u pages, %u from the file (%s), %u from the cache, "
+               "%u kept aside.\n", report.path, report.num_pages, report.pages_from_file,
+               report.kernel_copy ? "in the kernel" : "through a buffer",
+               report.pages_from_cache, report.pages_kept);
+        break;
+      case BACKUP_FAILED:
+        printf("Backup to %s failed: %s\n", report.path, report.reason);
+        break;
+      case BACKUP_CANCELLED:
+        printf("Backup to %s cancelled by compaction.\n", report.path);
+        break;
+    }
+    return META_COMMAND_SUCCESS;
+  }
   else {
     return META_COMMAND_UNRICOGNIZED_COMMAND;
   }
 }
 
-PrepareResult prepare_statement(buf_t* buf, statement_t* statement) {
+/* Decimal ids up to UINT64_MAX; a sign is only ever a negative id */
+static PrepareResult parse_id(const char* id_string, uint64_t* id) {
+  if (id_string[0] == '-') {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (!isdigit((unsigned char)id_string[0])) {
+    return PREPARE_SYTAX_ERROR;
+  }
+  char* end;
+  errno = 0;
+  *id = strtoull(id_string, &end, 10);
+  if (errno == ERANGE || *end != '\0') {
+    return PREPARE_SYTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+static PrepareResult parse_statement(buf_t* buf, statement_t* statement) {
   if(strncmp(buf->buf, "insert", 6) == 0) {
     statement->kind = STATEMENT_INSERT;
     char* keyword = strtok(buf->buf, " ");
@@ -36,9 +221,10 @@ PrepareResult prepare_statement(buf_t* buf, statement_t* statement) {
       return PREPARE_SYTAX_ERROR;
     }
 
-    int id = atoi(id_string);
-    if (id < 0) {
-      return PREPARE_NEGATIVE_ID;
+    uint64_t id;
+    PrepareResult id_result = parse_id(id_string, &id);
+    if (id_result != PREPARE_SUCCESS) {
+      return id_result;
     }
 
     if (strlen(username) > COLUMN_USERNAME_SIZE) {
@@ -57,103 +243,348 @@ PrepareResult prepare_statement(buf_t* buf, statement_t* statement) {
   }
   if(strncmp(buf->buf, "select", 6) == 0) {
     statement->kind = STATEMENT_SELECT;
+    statement->select_by_id = db_false;
+    if (buf->buf[6] == '\0') {
+      return PREPARE_SUCCESS;
+    }
+
+    int consumed = -1;
+    sscanf(buf->buf + 6, " where id = %n", &consumed);
+    if (consumed < 0) {
+      return PREPARE_SYTAX_ERROR;
+    }
+    uint64_t id;
+    PrepareResult id_result = parse_id(buf->buf + 6 + consumed, &id);
+    if (id_result != PREPARE_SUCCESS) {
+      return id_result;
+    }
+    statement->select_by_id = db_true;
+    statement->select_id = id;
     return PREPARE_SUCCESS;
   }
 
   return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
+PrepareResult prepare_statement(buf_t* buf, statement_t* statement) {
+  uint64_t start = stats_now_ns();
+  PrepareResult result = parse_statement(buf, statement);
+  stats_histogram_record(&prepare_latency, stats_now_ns() - start);
+  return result;
+}
+
+/*
+A split allocates at most one page per level plus a new root, and a
+drain inserts every buffered row, so room for that many splits is kept
+free. Short on room the buffer is drained early instead, which leaves
+only the single insert to account for.
+*/
+static db_bool has_room_for(table_t* table, uint32_t num_rows) {
+  uint32_t depth = get_tree_depth(table->pager, table->root_page_num);
+  return table->pager->num_pages + (uint64_t)num_rows * (depth + 1) <= TABLE_MAX_PAGES;
+}
+
+/*
+With a write buffer the tree is only probed for a duplicate; the row
+reaches its leaf when the buffer drains.
+*/
+static ExecuteResult execute_buffered_insert(statement_t* statement, table_t* table) {
+  memtable_t* memtable = table->memtable;
+  if (!has_room_for(table, memtable->count + 1)) {
+    table_drain(table);
+    if (!has_room_for(table, 1)) {
+      return EXECUTE_TABLE_FULL;
+    }
+  }
+
+  row_t* row_to_insert = &(statement->row_to_insert);
+  if (table_lookup(table, row_to_insert->id) != NULL) {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+
+  memtable_put(memtable, row_to_insert->id, row_to_insert);
+  if (table->bloom != NULL) {
+    bloom_add(table->bloom, row_to_insert->id);
+  }
+  if (memtable_full(memtable)) {
+    table_drain(table);
+  }
+
+  return EXECUTE_SUCCESS;
+}
+
 ExecuteResult execute_insert(statement_t* statement, table_t* table) {
-  void* node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
+  if (table->memtable != NULL) {
+    return execute_buffered_insert(statement, table);
+  }
+
+  if (!has_room_for(table, 1)) {
+    return EXECUTE_TABLE_FULL;
+  }
 
   row_t* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  cursor_t* cursor = table_find(table, key_to_insert);
+  uint64_t key_to_insert = row_to_insert->id;
+  cursor_t cursor;
+  table_find(table, key_to_insert, &cursor);
+
+  void* node = get_page(table->pager, cursor.page_num);
+  uint32_t num_cells = (*leaf_node_num_cells(node));
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+  if (cursor.cell_num < num_cells) {
+    uint64_t key_at_index = *leaf_node_key(node, cursor.cell_num);
     if (key_at_index == key_to_insert) {
       return EXECUTE_DUPLICATE_KEY;
     }
   }
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-
-  free(cursor);
+  leaf_node_insert(&cursor, row_to_insert->id, row_to_insert);
+  if (table->bloom != NULL) {
+    bloom_add(table->bloom, key_to_insert);
+  }
 
   return EXECUTE_SUCCESS;
 }
 
-void print_row(row_t* row) {
-  printf("(%d %s %s)\n", row->id, row->username, row->email);
-}
-
 ExecuteResult execute_select(statement_t* statement, table_t* table) {
-  cursor_t* cursor = table_start(table);
+  result_writer_t* writer = get_result_writer();
 
-  row_t row;
-  while(!cursor->end_of_table) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+  if (statement->select_by_id) {
+    void* value = table_lookup(table, statement->select_id);
+    row_view_t row;
+    if (value != NULL) {
+      row_view(value, &row);
+      result_write_row(writer, &row);
+      STATS_INC(STATS_ROWS_SCANNED);
+      STATS_INC(STATS_ROWS_RETURNED);
+    }
+    result_end(writer);
+    return EXECUTE_SUCCESS;
+  }
+
+  cursor_t cursor;
+  table_start(table, &cursor);
+
+  row_view_t row;
+  uint64_t num_rows = 0;
+  while(!cursor.end_of_table) {
+    row_view(cursor_value(&cursor), &row);
+    result_write_row(writer, &row);
+    cursor_advance(&cursor);
+    num_rows++;
   }
+  STATS_ADD(STATS_ROWS_SCANNED, num_rows);
+  STATS_ADD(STATS_ROWS_RETURNED, num_rows);
 
-  free(cursor);
+  result_end(writer);
 
   return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_statement(statement_t* statement, table_t* table) {
+  uint64_t start = stats_now_ns();
+  ExecuteResult result;
   switch(statement->kind) {
-    case STATEMENT_INSERT: return execute_insert(statement, table);
-    case STATEMENT_SELECT: return execute_select(statement, table);
+    case STATEMENT_INSERT: result = execute_insert(statement, table); break;
+    case STATEMENT_SELECT: result = execute_select(statement, table); break;
   }
+  stats_histogram_record(&statement_latency[statement->kind], stats_now_ns() - start);
+  return result;
 }
 
-table_t* db_open(const char* filename) {
-  page_t* pager = page_open(filename);
+/* Filled in place, so db_discard() frees it if the scan fails */
+static void bloom_rebuild(table_t* table, uint64_t max_keys) {
+  table->bloom = bloom_new(max_keys);
+  cursor_t cursor;
+  table_start(table, &cursor);
+  while (!cursor.end_of_table) {
+    bloom_add(table->bloom, cursor_key(&cursor));
+    cursor_advance(&cursor);
+  }
+}
+
+/*
+A new file gets the header and an empty root leaf right after it, in
+the page size and compression from the options; existing files keep
+their own. An error once the table exists discards it before passing
+the error on, so a library caller is not left with the file open.
+*/
+table_t* db_open(const char* filename, const db_options_t* options) {
+  db_header_t header;
+  HeaderResult header_result = header_read(filename, &header);
+  if (header_result == HEADER_UNSUPPORTED) {
+    db_fatal("Unsupported db file format version or page size.");
+  }
+  if (header_result == HEADER_LEGACY || header_result == HEADER_OUTDATED) {
+    switch (compact_upgrade(filename, &header, options)) {
+      case COMPACT_SUCCESS:
+        break;
+      case COMPACT_CORRUPT:
+        db_fatal("Db file is corrupt and cannot be upgraded to the current format.");
+        break;
+      default:
+        db_fatal("Db file is too large to upgrade to the current format.");
+    }
+    header_result = header_read(filename, &header);
+  }
+  if (header_result == HEADER_NEW_FILE) {
+    header.magic = DB_HEADER_MAGIC;
+    header.format_version = DB_FORMAT_VERSION;
+    header.page_size = options->page_size;
+    header.root_page_num = DB_HEADER_PAGE_NUM + 1;
+    header.flags = options->compress ? DB_HEADER_COMPRESSED : 0;
+    header.generation = 0;
+  }
+  /* What a sidecar saved by the last session carries; a new file has none */
+  uint64_t saved_generation = header.generation;
+  header.generation++;
+
+  page_t* pager = page_open(filename, options, header.page_size,
+                            (header.flags & DB_HEADER_COMPRESSED) != 0);
 
   table_t* table = malloc(sizeof(table_t));
   table->pager = pager;
-  table->root_page_num = 0;
+  table->root_page_num = header.root_page_num;
+  table->generation = header.generation;
+  pthread_mutex_init(&(table->lock), NULL);
+  table->checkpoint = NULL;
+  table->bloom = NULL;
+  table->hash_index = NULL;
+  table->warm = NULL;
+  table->backup = NULL;
+  table->memtable = NULL;
+  if (options->write_buffer_rows > 0) {
+    table->memtable = memtable_new(options->write_buffer_rows);
+  }
+
+  db_error_trap_t trap;
+  db_error_push(&trap);
+  if (setjmp(trap.env) != 0) {
+    db_discard(table);
+    db_fatal("%s", trap.message);
+  }
 
   if (pager->num_pages == 0) {
-    void* root_node = get_page(pager, 0);
+    header_store(pager, &header);
+    void* root_node = get_page_for_write(pager, table->root_page_num);
     initialize_leaf_node(root_node);
     set_node_root(root_node, db_true);
+  } else {
+    /* The new generation is on disk before any write of this session */
+    header_store(pager, &header);
+    page_flush(pager, DB_HEADER_PAGE_NUM);
+    page_sync(pager);
   }
 
+  if (options->bloom_filter) {
+    uint64_t max_keys = (uint64_t)LEAF_NODE_MAX_CELLS(pager->page_size) * TABLE_MAX_PAGES;
+    table->bloom = bloom_load(filename, pager->num_pages, saved_generation, max_keys);
+    if (table->bloom == NULL) {
+      bloom_rebuild(table, max_keys);
+    }
+    bloom_save(table->bloom, filename, pager->num_pages, table->generation, db_false);
+  }
+
+  if (options->hash_index) {
+    db_bool valid;
+    table->hash_index = hash_index_open(filename, options, pager->page_size, pager->num_pages,
+                                        saved_generation, &valid);
+    if (!valid) {
+      table_rebuild_hash_index(table);
+    }
+    hash_index_mark_open(table->hash_index);
+  }
+
+  if (options->checkpoint_interval_ms > 0) {
+    table->checkpoint = checkpoint_start(table, options->checkpoint_interval_ms,
+                                         options->checkpoint_dirty_ratio);
+    if (table->checkpoint == NULL) {
+      db_fatal("Unable to start checkpointer.");
+    }
+  }
+
+  /* Last, so nothing above races with the prefetcher for the table lock */
+  if (options->warm_restart) {
+    table->warm = warm_start(table);
+  }
+
+  db_error_pop(&trap);
   return table;
 }
 
+/*
+Stop the checkpointer first; buffered rows are then drained into the
+tree and what the checkpointer has not written yet is flushed here.
+A discarded table leaves its Bloom filter and hash index marked open,
+so they are rebuilt next time.
+*/
 void db_close(table_t* table) {
-  page_t* pager = table->pager;
-
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
-    }
+  if (table->backup != NULL) {
+    backup_wait(table->backup);
+    table->backup = NULL;
+  }
+  if (table->warm != NULL) {
+    warm_stop(table->warm);
+    table->warm = NULL;
+  }
+  if (table->checkpoint != NULL) {
+    checkpoint_stop(table->checkpoint);
+    table->checkpoint = NULL;
+  }
 
-    page_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+  if (table->memtable != NULL) {
+    table_drain(table);
+    memtable_free(table->memtable);
+    table->memtable = NULL;
   }
 
-  int result  = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  page_t* pager = table->pager;
+
+  page_flush_dirty(pager);
+  if (pager->options.direct_io) {
+    page_sync(pager);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+  /* Only once the pages are out may the filter and index claim to match them */
+  if (table->bloom != NULL) {
+    bloom_save(table->bloom, pager->filename, pager->num_pages, table->generation, db_true);
+    bloom_free(table->bloom);
+  }
+  if (table->hash_index != NULL) {
+    hash_index_close(table->hash_index, pager->num_pages, table->generation);
+  }
+  if (pager->options.warm_restart) {
+    warm_set_t set;
+    warm_snapshot(pager, &set);
+    warm_save(pager->filename, &set);
   }
 
-  free(pager);
+  page_close(pager);
+  pthread_mutex_destroy(&(table->lock));
   free(table);
-}
\ No newline at end of file
+}
+
+void db_discard(table_t* table) {
+  /* Nothing else holds the lock now, and the pager outlives the thread */
+  if (table->backup != NULL) {
+    backup_cancel(table->backup);
+    backup_wait(table->backup);
+  }
+  if (table->warm != NULL) {
+    warm_stop(table->warm);
+  }
+  if (table->checkpoint != NULL) {
+    checkpoint_stop(table->checkpoint);
+  }
+  if (table->memtable != NULL) {
+    memtable_free(table->memtable);
+  }
+  if (table->bloom != NULL) {
+    bloom_free(table->bloom);
+  }
+  if (table->hash_index != NULL) {
+    hash_index_discard(table->hash_index);
+  }
+  page_discard(table->pager);
+  pthread_mutex_destroy(&(table->lock));
+  free(table);
+}
@@ -4,6 +4,7 @@
 #include "buffer.h"
 #include "table.h"
 #include "row.h"
+#include "options.h"
 
 #define DEFAULT_DB_NAME ".db.db"
 
@@ -14,6 +15,9 @@ typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementKind;
 typedef struct __statement {
   StatementKind kind;
   row_t row_to_insert;
+  /* select where id = select_id */
+  db_bool select_by_id;
+  uint64_t select_id;
 } statement_t;
 
 typedef enum { 
@@ -34,7 +38,17 @@ typedef enum {
 
 ExecuteResult execute_statement(statement_t* statement, table_t* table);
 
-table_t* db_open(const char* filename);
+table_t* db_open(const char* filename, const db_options_t* options);
 void db_close(table_t*);
+/* Release a table after an engine error without writing anything */
+void db_discard(table_t*);
+
+/*
+ * The table behind a libdb handle, an escape hatch for the bundled
+ * tools. Declared here rather than in libdb.h, which stays free of
+ * engine types.
+ */
+struct __libdb;
+table_t* libdb_table(struct __libdb* db);
 
 #endif
\ No newline at end of file
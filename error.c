@@ -0,0 +1,35 @@
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+static _Thread_local db_error_trap_t* current_trap = NULL;
+
+void db_error_push(db_error_trap_t* trap) {
+  trap->message[0] = '\0';
+  trap->prev = current_trap;
+  current_trap = trap;
+}
+
+void db_error_pop(db_error_trap_t* trap) {
+  current_trap = trap->prev;
+}
+
+void db_fatal(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+
+  db_error_trap_t* trap = current_trap;
+  if (trap == NULL) {
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+  }
+
+  vsnprintf(trap->message, DB_ERROR_MESSAGE_SIZE, format, args);
+  va_end(args);
+  current_trap = trap->prev;
+  longjmp(trap->env, 1);
+}
@@ -0,0 +1,33 @@
+#ifndef __ERROR_H__
+#define __ERROR_H__
+#include <setjmp.h>
+
+// ---------- errors -------------
+#define DB_ERROR_MESSAGE_SIZE 256
+
+/*
+ * Unrecoverable engine errors (I/O failures, corrupt pages) go through
+ * db_fatal(). With no trap installed it prints the message and exits,
+ * which is what the REPL wants. Library entry points install a trap
+ * so the error unwinds back to them instead:
+ *
+ *   db_error_trap_t trap;
+ *   db_error_push(&trap);
+ *   if (setjmp(trap.env) == 0) {
+ *     ... engine calls ...
+ *     db_error_pop(&trap);
+ *   } else {
+ *     ... trap.message says what failed; the trap is already popped ...
+ *   }
+ */
+typedef struct __db_error_trap {
+  jmp_buf env;
+  char message[DB_ERROR_MESSAGE_SIZE];
+  struct __db_error_trap* prev;
+} db_error_trap_t;
+
+void db_error_push(db_error_trap_t* trap);
+void db_error_pop(db_error_trap_t* trap);
+_Noreturn void db_fatal(const char* format, ...);
+
+#endif
@@ -0,0 +1,296 @@
+#include "hash_index.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define HASH_INDEX_MAGIC 0x58444948 /* "HIDX" */
+#define HASH_INDEX_VERSION 5
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t clean;
+  uint32_t db_pages;
+  /* The db header's generation when the index was saved */
+  uint64_t generation;
+  uint32_t page_size;
+  /* Round: the table doubles from INITIAL_BUCKETS << level */
+  uint32_t level;
+  /* Next bucket to split in this round */
+  uint32_t next_split;
+  uint32_t num_entries;
+  /* Pages in use in the index file, meta page included */
+  uint32_t num_pages;
+} hash_meta_t;
+
+/* Packed to 12 bytes; padded to 16 a bucket page would hold a quarter fewer */
+typedef struct __attribute__((packed)) {
+  uint64_t key;
+  uint32_t leaf_page_num;
+} hash_entry_t;
+
+typedef struct {
+  uint32_t num_entries;
+  /* Next page of the chain, 0 for none */
+  uint32_t overflow_page_num;
+} hash_bucket_header_t;
+
+/* The directory fills the rest of the meta page */
+static uint32_t max_buckets(hash_index_t* index) {
+  return (index->page_size - sizeof(hash_meta_t)) / sizeof(uint32_t);
+}
+
+static uint32_t bucket_capacity(hash_index_t* index) {
+  return (index->page_size - sizeof(hash_bucket_header_t)) / sizeof(hash_entry_t);
+}
+
+static hash_meta_t* index_meta(hash_index_t* index) {
+  return get_page(index->pager, 0);
+}
+
+static uint32_t* bucket_directory(hash_meta_t* meta) {
+  return (uint32_t*)(meta + 1);
+}
+
+static hash_bucket_header_t* bucket_header(void* page) {
+  return page;
+}
+
+static hash_entry_t* bucket_entries(void* page) {
+  return (hash_entry_t*)((hash_bucket_header_t*)page + 1);
+}
+
+static uint32_t hash_key(uint64_t key) {
+  uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) ^ (uint32_t)h;
+}
+
+static uint32_t num_buckets(hash_meta_t* meta) {
+  return (HASH_INDEX_INITIAL_BUCKETS << meta->level) + meta->next_split;
+}
+
+static uint32_t bucket_of(hash_meta_t* meta, uint64_t key) {
+  uint32_t h = hash_key(key);
+  uint32_t bucket = h % (HASH_INDEX_INITIAL_BUCKETS << meta->level);
+  if (bucket < meta->next_split) {
+    bucket = h % (HASH_INDEX_INITIAL_BUCKETS << (meta->level + 1));
+  }
+  return bucket;
+}
+
+static uint32_t new_bucket_page(hash_index_t* index) {
+  hash_meta_t* meta = get_page_for_write(index->pager, 0);
+  uint32_t page_num = meta->num_pages++;
+  void* page = get_page_for_write(index->pager, page_num);
+  memset(page, 0, index->page_size);
+  return page_num;
+}
+
+void hash_index_reset(hash_index_t* index) {
+  hash_meta_t* meta = get_page_for_write(index->pager, 0);
+  memset(meta, 0, index->page_size);
+  meta->magic = HASH_INDEX_MAGIC;
+  meta->version = HASH_INDEX_VERSION;
+  meta->page_size = index->page_size;
+  meta->num_pages = 1;
+  for (uint32_t i = 0; i < HASH_INDEX_INITIAL_BUCKETS; i++) {
+    bucket_directory(meta)[i] = new_bucket_page(index);
+  }
+}
+
+/*
+An index written for another page size, or by an older version, would
+not even be a whole number of pages now; it is only a cache, so it goes.
+*/
+static void discard_foreign(const char* filename, uint32_t page_size) {
+  int fd = open(filename, O_RDWR);
+  if (fd == -1) {
+    return;
+  }
+  hash_meta_t meta;
+  if (pread(fd, &meta, sizeof(meta), 0) != sizeof(meta) || meta.magic != HASH_INDEX_MAGIC ||
+      meta.version != HASH_INDEX_VERSION || meta.page_size != page_size) {
+    if (ftruncate(fd, 0) == -1) {
+      close(fd);
+      db_fatal("Unable to reset hash index.");
+    }
+  }
+  close(fd);
+}
+
+hash_index_t* hash_index_open(const char* db_filename, const db_options_t* options,
+                              uint32_t page_size, uint32_t db_pages, uint64_t generation,
+                              db_bool* valid) {
+  size_t len = strlen(db_filename) + strlen(HASH_INDEX_FILE_SUFFIX) + 1;
+  char* filename = malloc(len);
+  snprintf(filename, len, "%s%s", db_filename, HASH_INDEX_FILE_SUFFIX);
+
+  discard_foreign(filename, page_size);
+  page_t* pager = page_open(filename, options, page_size, db_false);
+  free(filename);
+  hash_index_t* index = malloc(sizeof(hash_index_t));
+  index->page_size = page_size;
+  index->pager = pager;
+
+  db_error_trap_t trap;
+  db_error_push(&trap);
+  if (setjmp(trap.env) == 0) {
+    *valid = db_false;
+    if (index->pager->num_pages > 0) {
+      hash_meta_t* meta = index_meta(index);
+      *valid = meta->magic == HASH_INDEX_MAGIC && meta->version == HASH_INDEX_VERSION &&
+               meta->clean && meta->db_pages == db_pages && meta->generation == generation &&
+               meta->num_pages <= index->pager->num_pages;
+    }
+    if (!*valid) {
+      hash_index_reset(index);
+    }
+    db_error_pop(&trap);
+  } else {
+    hash_index_discard(index);
+    db_fatal("%s", trap.message);
+  }
+  return index;
+}
+
+static void write_meta(hash_index_t* index) {
+  page_flush(index->pager, 0);
+  page_sync(index->pager);
+}
+
+void hash_index_mark_open(hash_index_t* index) {
+  hash_meta_t* meta = get_page_for_write(index->pager, 0);
+  meta->clean = 0;
+  write_meta(index);
+}
+
+/* Bucket pages go out before the meta page that declares them clean */
+void hash_index_close(hash_index_t* index, uint32_t db_pages, uint64_t generation) {
+  page_flush_dirty(index->pager);
+  page_sync(index->pager);
+
+  hash_meta_t* meta = get_page_for_write(index->pager, 0);
+  meta->clean = 1;
+  meta->db_pages = db_pages;
+  meta->generation = generation;
+  write_meta(index);
+
+  page_close(index->pager);
+  free(index);
+}
+
+void hash_index_discard(hash_index_t* index) {
+  page_discard(index->pager);
+  free(index);
+}
+
+uint32_t hash_index_get(hash_index_t* index, uint64_t key) {
+  hash_meta_t* meta = index_meta(index);
+  uint32_t page_num = bucket_directory(meta)[bucket_of(meta, key)];
+  while (page_num != 0) {
+    void* page = get_page(index->pager, page_num);
+    hash_entry_t* entries = bucket_entries(page);
+    uint32_t count = bucket_header(page)->num_entries;
+    for (uint32_t i = 0; i < count; i++) {
+      if (entries[i].key == key) {
+        return entries[i].leaf_page_num;
+      }
+    }
+    page_num = bucket_header(page)->overflow_page_num;
+  }
+  return HASH_INDEX_NOT_FOUND;
+}
+
+/* Add an entry known to be absent to the chain starting at page_num */
+static void bucket_append(hash_index_t* index, uint32_t page_num, hash_entry_t entry) {
+  while (1) {
+    void* page = get_page_for_write(index->pager, page_num);
+    hash_bucket_header_t* header = bucket_header(page);
+    if (header->num_entries < bucket_capacity(index)) {
+      bucket_entries(page)[header->num_entries++] = entry;
+      return;
+    }
+    if (header->overflow_page_num == 0) {
+      header->overflow_page_num = new_bucket_page(index);
+    }
+    page_num = header->overflow_page_num;
+  }
+}
+
+/*
+Split the next bucket of the round: its entries are rehashed with the
+next round's modulus into itself and a new bucket at the end. The old
+chain keeps its pages; emptied overflow pages stay linked for reuse.
+*/
+static void split_bucket(hash_index_t* index) {
+  hash_meta_t* meta = get_page_for_write(index->pager, 0);
+  uint32_t old_bucket = meta->next_split;
+  uint32_t new_bucket = num_buckets(meta);
+  uint32_t modulus = HASH_INDEX_INITIAL_BUCKETS << (meta->level + 1);
+
+  bucket_directory(meta)[new_bucket] = new_bucket_page(index);
+  meta->next_split++;
+  if (meta->next_split == HASH_INDEX_INITIAL_BUCKETS << meta->level) {
+    meta->level++;
+    meta->next_split = 0;
+  }
+
+  uint32_t chain_entries = 0;
+  for (uint32_t page_num = bucket_directory(meta)[old_bucket]; page_num != 0;) {
+    hash_bucket_header_t* header = bucket_header(get_page(index->pager, page_num));
+    chain_entries += header->num_entries;
+    page_num = header->overflow_page_num;
+  }
+  hash_entry_t* entries = malloc((chain_entries + 1) * sizeof(hash_entry_t));
+
+  uint32_t count = 0;
+  for (uint32_t page_num = bucket_directory(meta)[old_bucket]; page_num != 0;) {
+    void* page = get_page_for_write(index->pager, page_num);
+    hash_bucket_header_t* header = bucket_header(page);
+    memcpy(entries + count, bucket_entries(page), header->num_entries * sizeof(hash_entry_t));
+    count += header->num_entries;
+    header->num_entries = 0;
+    page_num = header->overflow_page_num;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t bucket = hash_key(entries[i].key) % modulus == old_bucket ? old_bucket : new_bucket;
+    bucket_append(index, bucket_directory(meta)[bucket], entries[i]);
+  }
+  free(entries);
+}
+
+void hash_index_put(hash_index_t* index, uint64_t key, uint32_t leaf_page_num) {
+  hash_meta_t* meta = index_meta(index);
+  uint32_t first_page_num = bucket_directory(meta)[bucket_of(meta, key)];
+
+  for (uint32_t page_num = first_page_num; page_num != 0;) {
+    void* page = get_page(index->pager, page_num);
+    hash_entry_t* entries = bucket_entries(page);
+    uint32_t count = bucket_header(page)->num_entries;
+    for (uint32_t i = 0; i < count; i++) {
+      if (entries[i].key == key) {
+        if (entries[i].leaf_page_num != leaf_page_num) {
+          page_mark_dirty(index->pager, page_num);
+          entries[i].leaf_page_num = leaf_page_num;
+        }
+        return;
+      }
+    }
+    page_num = bucket_header(page)->overflow_page_num;
+  }
+
+  hash_entry_t entry = { key, leaf_page_num };
+  bucket_append(index, first_page_num, entry);
+
+  meta = get_page_for_write(index->pager, 0);
+  meta->num_entries++;
+  if (meta->num_entries > HASH_INDEX_MAX_LOAD * num_buckets(meta) * bucket_capacity(index) &&
+      num_buckets(meta) < max_buckets(index)) {
+    split_bucket(index);
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef __HASH_INDEX_H__
+#define __HASH_INDEX_H__
+#include <stdint.h>
+#include "def.h"
+#include "page.h"
+
+// ---------- hash index -------------
+/*
+ * Linear hash from key to the leaf page holding it, kept in <db>.hidx
+ * and paged through its own page_t. Page 0 is the meta page with the
+ * bucket directory; buckets are chains of pages of (key, leaf) pairs.
+ * One bucket is split whenever the load passes HASH_INDEX_MAX_LOAD.
+ *
+ * Index pages are the size of the db's pages, so the directory and the
+ * buckets both grow with them: 4K pages hold ~1K buckets of 340 keys,
+ * 64K pages ~16K buckets of 5K keys, more than a full table of either
+ * size has rows. Past the directory's capacity chains would grow.
+ *
+ * Like the Bloom filter the file carries a clean flag, the db page
+ * count and the db generation it was written for, and is rebuilt from
+ * the table otherwise.
+ */
+#define HASH_INDEX_FILE_SUFFIX ".hidx"
+#define HASH_INDEX_NOT_FOUND UINT32_MAX
+#define HASH_INDEX_INITIAL_BUCKETS 4u
+#define HASH_INDEX_MAX_LOAD 0.75
+
+typedef struct {
+  page_t* pager;
+  uint32_t page_size;
+} hash_index_t;
+
+/* Open or create the index for a db; *valid says whether it can be used as is */
+hash_index_t* hash_index_open(const char* db_filename, const db_options_t* options,
+                              uint32_t page_size, uint32_t db_pages, uint64_t generation,
+                              db_bool* valid);
+/* Drop every entry, e.g. to rebuild after the leaves moved */
+void hash_index_reset(hash_index_t* index);
+/* Mark the file unclean until hash_index_close() */
+void hash_index_mark_open(hash_index_t* index);
+void hash_index_close(hash_index_t* index, uint32_t db_pages, uint64_t generation);
+void hash_index_discard(hash_index_t* index);
+
+/* Insert or update the leaf for key */
+void hash_index_put(hash_index_t* index, uint64_t key, uint32_t leaf_page_num);
+/* Leaf page holding key, or HASH_INDEX_NOT_FOUND */
+uint32_t hash_index_get(hash_index_t* index, uint64_t key);
+
+#endif
@@ -0,0 +1,52 @@
+#include "header.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+db_bool header_valid_page_size(uint32_t page_size) {
+  return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+         (page_size & (page_size - 1)) == 0;
+}
+
+/*
+Read through a plain descriptor: the page size, and with it the
+alignment direct I/O would need, is what we are trying to learn.
+*/
+HeaderResult header_read(const char* filename, db_header_t* header) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return HEADER_NEW_FILE;
+  }
+
+  ssize_t bytes_read = pread(fd, header, sizeof(db_header_t), 0);
+  close(fd);
+
+  if (bytes_read == 0) {
+    return HEADER_NEW_FILE;
+  }
+  if (bytes_read != sizeof(db_header_t) || header->magic != DB_HEADER_MAGIC) {
+    header->magic = DB_HEADER_MAGIC;
+    header->format_version = 0;
+    header->page_size = LEGACY_PAGE_SIZE;
+    header->root_page_num = LEGACY_ROOT_PAGE_NUM;
+    header->flags = 0;
+    header->generation = 0;
+    return HEADER_LEGACY;
+  }
+  if (header->format_version < DB_FORMAT_VERSION_UPGRADABLE ||
+      header->format_version > DB_FORMAT_VERSION ||
+      !header_valid_page_size(header->page_size) ||
+      header->root_page_num == DB_HEADER_PAGE_NUM ||
+      (header->flags & ~DB_HEADER_KNOWN_FLAGS) != 0) {
+    return HEADER_UNSUPPORTED;
+  }
+  return header->format_version == DB_FORMAT_VERSION ? HEADER_OK : HEADER_OUTDATED;
+}
+
+void header_store(page_t* pager, const db_header_t* header) {
+  void* page = get_page_for_write(pager, DB_HEADER_PAGE_NUM);
+  memset(page, 0, pager->page_size);
+  memcpy(page, header, sizeof(db_header_t));
+}
@@ -0,0 +1,53 @@
+#ifndef __HEADER_H__
+#define __HEADER_H__
+#include <stdint.h>
+#include "page.h"
+
+// ---------- file header -------------
+/*
+ * Page 0 of a db file describes the file; the tree starts at the root
+ * page it names. Files written before the header existed are 4 KiB
+ * page files with the root at page 0. Those, and format 1 files with
+ * their 32 bit keys, are rewritten in the current format when opened.
+ *
+ * The generation counts the opens of the file and is synced at each
+ * one, before anything else is written. Sidecar files (Bloom filter,
+ * hash index) record the generation they were saved in, so one written
+ * before a session that did not maintain it no longer matches.
+ */
+#define DB_HEADER_MAGIC 0x31424454 /* "TDB1" */
+#define DB_FORMAT_VERSION 2
+/* Oldest version db_open() can upgrade */
+#define DB_FORMAT_VERSION_UPGRADABLE 1
+#define DB_HEADER_PAGE_NUM 0
+#define LEGACY_PAGE_SIZE 4096
+#define LEGACY_ROOT_PAGE_NUM 0
+
+/* Pages past the header are stored compressed; see the extent map in page.h */
+#define DB_HEADER_COMPRESSED 0x1
+#define DB_HEADER_KNOWN_FLAGS DB_HEADER_COMPRESSED
+
+typedef struct {
+  uint32_t magic;
+  uint32_t format_version;
+  uint32_t page_size;
+  uint32_t root_page_num;
+  uint32_t flags;
+  uint64_t generation;
+} db_header_t;
+
+typedef enum {
+  HEADER_OK,
+  HEADER_NEW_FILE,
+  HEADER_LEGACY,
+  HEADER_OUTDATED,
+  HEADER_UNSUPPORTED
+} HeaderResult;
+
+db_bool header_valid_page_size(uint32_t page_size);
+/* Read the header of filename before it is opened with a pager */
+HeaderResult header_read(const char* filename, db_header_t* header);
+/* Write header into page 0 of pager */
+void header_store(page_t* pager, const db_header_t* header);
+
+#endif
@@ -0,0 +1,395 @@
+#include "import.h"
+#include "tree.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Longest id that can still be in range */
+#define IMPORT_ID_DIGITS 20
+
+typedef struct {
+  uint64_t key;
+  /* Cell number within the chunk, which also keeps equal keys in file order */
+  uint32_t index;
+} import_key_t;
+
+typedef struct {
+  const char* start;
+  const char* end;
+  char delimiter;
+  db_bool first;
+  /* Leaf cells, LEAF_NODE_CELL_SIZE bytes each, in file order */
+  char* cells;
+  uint32_t count;
+  uint32_t capacity;
+  /* Sorted by key once parsed */
+  import_key_t* keys;
+  /* Lines parsed; on an error, up to and including the bad one */
+  uint64_t lines;
+  const char* reason;
+  /* Merge position */
+  uint32_t next;
+  pthread_t thread;
+  db_bool threaded;
+} import_chunk_t;
+
+/*
+Copy one field into out and leave *cursor on the delimiter after it.
+Returns NULL or why the field is unusable.
+*/
+static const char* read_field(const char** cursor, const char* end, char delimiter,
+                              char* out, uint32_t cap, uint32_t* length,
+                              const char* too_long) {
+  const char* p = *cursor;
+  uint32_t n = 0;
+  if (p < end && *p == '"') {
+    p++;
+    while (1) {
+      if (p == end) {
+        return "unterminated quote";
+      }
+      if (*p == '"') {
+        p++;
+        if (p == end || *p != '"') {
+          break;
+        }
+      }
+      if (n == cap) {
+        return too_long;
+      }
+      out[n++] = *p++;
+    }
+    if (p < end && *p != delimiter) {
+      return "text after closing quote";
+    }
+  } else {
+    while (p < end && *p != delimiter) {
+      if (n == cap) {
+        return too_long;
+      }
+      out[n++] = *p++;
+    }
+  }
+  if (n == 0) {
+    return "empty field";
+  }
+  *cursor = p;
+  *length = n;
+  return NULL;
+}
+
+/* Fill a zeroed cell from one line, without its newline */
+static const char* parse_line(const char* p, const char* end, char delimiter, char* cell) {
+  char id_text[IMPORT_ID_DIGITS];
+  char* row = cell + LEAF_NODE_VALUE_OFFSET;
+  uint32_t length;
+  const char* reason;
+
+  if ((reason = read_field(&p, end, delimiter, id_text, IMPORT_ID_DIGITS, &length,
+                           "id out of range")) != NULL) {
+    return reason;
+  }
+  uint64_t id = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    if (id_text[i] < '0' || id_text[i] > '9') {
+      return "id is not a non-negative integer";
+    }
+    uint64_t digit = id_text[i] - '0';
+    if (id > (UINT64_MAX - digit) / 10) {
+      return "id out of range";
+    }
+    id = id * 10 + digit;
+  }
+
+  if (p == end) {
+    return "expected 3 fields";
+  }
+  p++;
+  if ((reason = read_field(&p, end, delimiter, row + USERNAME_OFFSET, COLUMN_USERNAME_SIZE,
+                           &length, "username too long")) != NULL) {
+    return reason;
+  }
+  if (p == end) {
+    return "expected 3 fields";
+  }
+  p++;
+  if ((reason = read_field(&p, end, delimiter, row + EMAIL_OFFSET, COLUMN_EMAIL_SIZE,
+                           &length, "email too long")) != NULL) {
+    return reason;
+  }
+  if (p != end) {
+    return "expected 3 fields";
+  }
+
+  memcpy(cell + LEAF_NODE_KEY_OFFSET, &id, LEAF_NODE_KEY_SIZE);
+  memcpy(row + ID_OFFSET, &id, ID_SIZE);
+  return NULL;
+}
+
+static int compare_keys(const void* a, const void* b) {
+  const import_key_t* x = a;
+  const import_key_t* y = b;
+  if (x->key != y->key) {
+    return x->key < y->key ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void* import_worker(void* arg) {
+  import_chunk_t* chunk = arg;
+  const char* p = chunk->start;
+
+  while (p < chunk->end) {
+    const char* line_end = memchr(p, '\n', chunk->end - p);
+    const char* next = line_end != NULL ? line_end + 1 : chunk->end;
+    if (line_end == NULL) {
+      line_end = chunk->end;
+    }
+    if (line_end > p && line_end[-1] == '\r') {
+      line_end--;
+    }
+    chunk->lines++;
+
+    db_bool header = chunk->first && chunk->lines == 1 && (*p < '0' || *p > '9');
+    if (line_end == p || header) {
+      p = next;
+      continue;
+    }
+
+    if (chunk->count == chunk->capacity) {
+      chunk->capacity *= 2;
+      chunk->cells = realloc(chunk->cells, (size_t)chunk->capacity * LEAF_NODE_CELL_SIZE);
+    }
+    char* cell = chunk->cells + (size_t)chunk->count * LEAF_NODE_CELL_SIZE;
+    memset(cell, 0, LEAF_NODE_CELL_SIZE);
+    if ((chunk->reason = parse_line(p, line_end, chunk->delimiter, cell)) != NULL) {
+      return NULL;
+    }
+    chunk->count++;
+    p = next;
+  }
+
+  chunk->keys = malloc(sizeof(import_key_t) * (chunk->count + 1));
+  for (uint32_t i = 0; i < chunk->count; i++) {
+    memcpy(&(chunk->keys[i].key), chunk->cells + (size_t)i * LEAF_NODE_CELL_SIZE,
+           LEAF_NODE_KEY_SIZE);
+    chunk->keys[i].index = i;
+  }
+  qsort(chunk->keys, chunk->count, sizeof(import_key_t), compare_keys);
+  return NULL;
+}
+
+/* Smallest unmerged cell over all chunks, or NULL when they are exhausted */
+static char* merge_peek(import_chunk_t* chunks, uint32_t num_chunks, uint32_t* from) {
+  char* best = NULL;
+  uint64_t best_key = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    import_chunk_t* chunk = &chunks[i];
+    if (chunk->next == chunk->count) {
+      continue;
+    }
+    import_key_t* head = &(chunk->keys[chunk->next]);
+    if (best == NULL || head->key < best_key) {
+      best = chunk->cells + (size_t)head->index * LEAF_NODE_CELL_SIZE;
+      best_key = head->key;
+      *from = i;
+    }
+  }
+  return best;
+}
+
+/* Step past the cell merge_peek() returned and any later copies of its key */
+static void merge_advance(import_chunk_t* chunks, uint32_t num_chunks, uint32_t from,
+                          import_report_t* report) {
+  uint64_t key = chunks[from].keys[chunks[from].next++].key;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    import_chunk_t* chunk = &chunks[i];
+    while (chunk->next < chunk->count && chunk->keys[chunk->next].key == key) {
+      chunk->next++;
+      report->duplicates++;
+    }
+  }
+}
+
+static db_bool in_leaf(table_t* table, uint32_t page_num, void* node, uint64_t key) {
+  cursor_t cursor;
+  leaf_node_find(table, page_num, key, &cursor);
+  return cursor.cell_num < *leaf_node_num_cells(node) &&
+         *leaf_node_key(node, cursor.cell_num) == key;
+}
+
+/*
+Same shape as table_drain(): every run of keys that lands in one leaf
+with room goes in with a single merge, and a full leaf takes the next
+key through the usual split.
+*/
+static ImportResult import_write(table_t* table, import_chunk_t* chunks, uint32_t num_chunks,
+                                 import_report_t* report) {
+  page_t* pager = table->pager;
+  uint32_t max_cells = LEAF_NODE_MAX_CELLS(pager->page_size);
+  void* cells[LEAF_NODE_MAX_CELLS_LIMIT];
+  uint32_t from;
+  char* cell = merge_peek(chunks, num_chunks, &from);
+
+  while (cell != NULL) {
+    uint64_t key = *(uint64_t*)cell;
+    cursor_t cursor;
+    table_find(table, key, &cursor);
+    void* node = get_page(pager, cursor.page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    if (num_cells >= max_cells && !in_leaf(table, cursor.page_num, node, key)) {
+      /* A split allocates at most one page per level plus a new root */
+      uint32_t depth = get_tree_depth(pager, table->root_page_num);
+      if (pager->num_pages + depth + 1 > TABLE_MAX_PAGES) {
+        return IMPORT_TABLE_FULL;
+      }
+      row_t row;
+      deserialize_row(cell + LEAF_NODE_VALUE_OFFSET, &row);
+      leaf_node_insert(&cursor, key, &row);
+      if (table->bloom != NULL) {
+        bloom_add(table->bloom, key);
+      }
+      report->rows++;
+      merge_advance(chunks, num_chunks, from, report);
+      cell = merge_peek(chunks, num_chunks, &from);
+      continue;
+    }
+
+    db_bool rightmost = *leaf_node_next_leaf(node) == 0;
+    uint64_t max_key = num_cells > 0 ? *leaf_node_key(node, num_cells - 1) : 0;
+    uint32_t count = 0;
+    do {
+      if (in_leaf(table, cursor.page_num, node, key)) {
+        report->duplicates++;
+      } else {
+        cells[count++] = cell;
+      }
+      merge_advance(chunks, num_chunks, from, report);
+      cell = merge_peek(chunks, num_chunks, &from);
+      key = cell != NULL ? *(uint64_t*)cell : 0;
+    } while (cell != NULL && num_cells + count < max_cells && (rightmost || key <= max_key));
+
+    if (count > 0) {
+      leaf_node_insert_cells(table, cursor.page_num, cells, count);
+    }
+    if (table->bloom != NULL) {
+      for (uint32_t i = 0; i < count; i++) {
+        bloom_add(table->bloom, *(uint64_t*)cells[i]);
+      }
+    }
+    report->rows += count;
+  }
+
+  return IMPORT_SUCCESS;
+}
+
+static uint32_t import_num_workers(size_t size) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = size / IMPORT_MIN_CHUNK_SIZE;
+  if (cpus > 0 && workers > (size_t)cpus) {
+    workers = cpus;
+  }
+  if (workers > IMPORT_MAX_WORKERS) {
+    workers = IMPORT_MAX_WORKERS;
+  }
+  return workers > 0 ? workers : 1;
+}
+
+/*
+Buffered rows are drained first, so that the tree alone decides what
+is a duplicate.
+*/
+ImportResult table_import(table_t* table, const char* filename, import_report_t* report) {
+  memset(report, 0, sizeof(import_report_t));
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return IMPORT_CANNOT_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return IMPORT_CANNOT_OPEN;
+  }
+  size_t size = st.st_size;
+  const char* data = NULL;
+  if (size > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return IMPORT_CANNOT_OPEN;
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  const char* end = data + size;
+  const char* first_line_end = size > 0 ? memchr(data, '\n', size) : NULL;
+  size_t first_line_length = first_line_end != NULL ? (size_t)(first_line_end - data) : size;
+  char delimiter = size > 0 && memchr(data, '\t', first_line_length) != NULL ? '\t' : ',';
+
+  uint32_t num_chunks = import_num_workers(size);
+  import_chunk_t* chunks = calloc(num_chunks, sizeof(import_chunk_t));
+  const char* start = data;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    import_chunk_t* chunk = &chunks[i];
+    const char* chunk_end = i + 1 == num_chunks ? end : data + size / num_chunks * (i + 1);
+    if (chunk_end < start) {
+      chunk_end = start;
+    }
+    while (chunk_end < end && chunk_end > data && chunk_end[-1] != '\n') {
+      chunk_end++;
+    }
+    chunk->start = start;
+    chunk->end = chunk_end;
+    chunk->delimiter = delimiter;
+    chunk->first = i == 0;
+    /* Lines are rarely shorter than 32 bytes */
+    chunk->capacity = (chunk_end - start) / 32 + 16;
+    chunk->cells = malloc((size_t)chunk->capacity * LEAF_NODE_CELL_SIZE);
+    start = chunk_end;
+
+    chunk->threaded = pthread_create(&(chunk->thread), NULL, import_worker, chunk) == 0;
+    if (!chunk->threaded) {
+      import_worker(chunk);
+    }
+  }
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    if (chunks[i].threaded) {
+      pthread_join(chunks[i].thread, NULL);
+    }
+  }
+
+  ImportResult result = IMPORT_SUCCESS;
+  uint64_t lines = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    lines += chunks[i].lines;
+    if (chunks[i].reason != NULL) {
+      report->line = lines;
+      report->reason = chunks[i].reason;
+      result = IMPORT_INVALID_LINE;
+      break;
+    }
+  }
+
+  if (result == IMPORT_SUCCESS) {
+    table_drain(table);
+    result = import_write(table, chunks, num_chunks, report);
+  }
+
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    free(chunks[i].cells);
+    free(chunks[i].keys);
+  }
+  free(chunks);
+  if (size > 0) {
+    munmap((void*)data, size);
+  }
+  return result;
+}
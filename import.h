@@ -0,0 +1,43 @@
+#ifndef __IMPORT_H__
+#define __IMPORT_H__
+
+#include <stdint.h>
+#include "table.h"
+
+// ---------- import -------------
+/*
+ * Bulk load of "id,username,email" lines from a CSV or TSV file (tab
+ * separated when the first line has a tab). Fields may be "quoted",
+ * with "" for a quote, but may not span lines. A first line that does
+ * not start with a digit is taken as a header and skipped.
+ *
+ * The file is mapped and cut at line boundaries into one chunk per
+ * worker thread. Workers parse and validate their chunk into leaf
+ * cells and sort them; the calling thread then merges the chunks and
+ * inserts in key order, filling each leaf with one batch like a write
+ * buffer drain. Nothing is written unless every line is valid.
+ */
+#define IMPORT_MAX_WORKERS 16
+/* Smaller files get fewer workers */
+#define IMPORT_MIN_CHUNK_SIZE (1 << 20)
+
+typedef enum {
+  IMPORT_SUCCESS,
+  IMPORT_CANNOT_OPEN,
+  IMPORT_INVALID_LINE,
+  IMPORT_TABLE_FULL
+} ImportResult;
+
+typedef struct {
+  uint64_t rows;
+  /* Ids already in the table, or repeated in the file; the first one wins */
+  uint64_t duplicates;
+  /* IMPORT_INVALID_LINE: the first bad line, counting from 1, and why */
+  uint64_t line;
+  const char* reason;
+} import_report_t;
+
+/* Caller holds the table lock. On IMPORT_TABLE_FULL the rows before the failure stay */
+ImportResult table_import(table_t* table, const char* filename, import_report_t* report);
+
+#endif
@@ -0,0 +1,322 @@
+#include "libdb.h"
+#include "db.h"
+#include "tree.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct __libdb {
+  table_t* table;
+  db_bool failed;
+  char errmsg[DB_ERROR_MESSAGE_SIZE];
+};
+
+struct __libdb_iter {
+  libdb_t* db;
+  cursor_t cursor;
+};
+
+/*
+Run the following block with engine errors trapped. The block must
+call db_error_pop(&trap) on the way out; the else branch runs after
+an error with the trap already popped.
+*/
+#define LIBDB_TRY(trap) \
+  db_error_push(&(trap)); \
+  if (setjmp((trap).env) == 0)
+
+static DbStatus libdb_fail(libdb_t* db, db_error_trap_t* trap) {
+  db->failed = db_true;
+  strncpy(db->errmsg, trap->message, DB_ERROR_MESSAGE_SIZE - 1);
+  db->errmsg[DB_ERROR_MESSAGE_SIZE - 1] = '\0';
+  return DB_IO_ERROR;
+}
+
+static DbStatus libdb_invalid(libdb_t* db, DbStatus status, const char* message) {
+  strncpy(db->errmsg, message, DB_ERROR_MESSAGE_SIZE - 1);
+  db->errmsg[DB_ERROR_MESSAGE_SIZE - 1] = '\0';
+  return status;
+}
+
+static DbStatus execute_status(ExecuteResult result) {
+  switch (result) {
+    case EXECUTE_SUCCESS: return DB_OK;
+    case EXECUTE_DUPLICATE_KEY: return DB_DUPLICATE_KEY;
+    case EXECUTE_TABLE_FULL: return DB_TABLE_FULL;
+  }
+  return DB_IO_ERROR;
+}
+
+/*
+Like sqlite3_open(), a handle is returned even when opening fails so
+the caller can read libdb_errmsg(); it still has to be closed.
+*/
+DbStatus libdb_open(const char* filename, libdb_t** out) {
+  return libdb_open_with(filename, NULL, out);
+}
+
+DbStatus libdb_open_with(const char* filename, const db_options_t* options, libdb_t** out) {
+  if (filename == NULL || out == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  db_options_t defaults;
+  if (options == NULL) {
+    db_options_init(&defaults);
+    options = &defaults;
+  }
+
+  libdb_t* db = calloc(1, sizeof(libdb_t));
+  *out = db;
+
+  db_error_trap_t trap;
+  LIBDB_TRY(trap) {
+    db->table = db_open(filename, options);
+    db_error_pop(&trap);
+  } else {
+    return libdb_fail(db, &trap);
+  }
+
+  return DB_OK;
+}
+
+DbStatus libdb_close(libdb_t* db) {
+  if (db == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  DbStatus status = DB_OK;
+  if (db->table != NULL) {
+    if (db->failed) {
+      db_discard(db->table);
+    } else {
+      db_error_trap_t trap;
+      LIBDB_TRY(trap) {
+        db_close(db->table);
+        db_error_pop(&trap);
+      } else {
+        status = DB_IO_ERROR;
+      }
+    }
+  }
+
+  free(db);
+  return status;
+}
+
+static DbStatus libdb_execute(libdb_t* db, statement_t* statement) {
+  volatile DbStatus status = DB_IO_ERROR;
+  table_lock(db->table);
+  db_error_trap_t trap;
+  LIBDB_TRY(trap) {
+    status = execute_status(execute_statement(statement, db->table));
+    db_error_pop(&trap);
+  } else {
+    table_unlock(db->table);
+    return libdb_fail(db, &trap);
+  }
+  table_unlock(db->table);
+
+  return status;
+}
+
+DbStatus libdb_insert(libdb_t* db, uint64_t id, const char* username, const char* email) {
+  if (db == NULL || username == NULL || email == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  if (db->failed) {
+    return DB_IO_ERROR;
+  }
+
+  size_t username_len = strlen(username);
+  size_t email_len = strlen(email);
+  if (username_len > COLUMN_USERNAME_SIZE || email_len > COLUMN_EMAIL_SIZE) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  statement_t statement;
+  memset(&statement, 0, sizeof(statement_t));
+  statement.kind = STATEMENT_INSERT;
+  statement.row_to_insert.id = id;
+  memcpy(statement.row_to_insert.username, username, username_len);
+  memcpy(statement.row_to_insert.email, email, email_len);
+
+  return libdb_execute(db, &statement);
+}
+
+DbStatus libdb_exec(libdb_t* db, const char* sql, DbStatementKind* kind) {
+  if (db == NULL || sql == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  if (db->failed) {
+    return DB_IO_ERROR;
+  }
+
+  size_t length = strlen(sql);
+  if (length >= MAX_BUF_SIZE) {
+    return libdb_invalid(db, DB_INVALID_ARGUMENT, "Statement is too long.");
+  }
+  /* prepare_statement() tokenizes in place */
+  buf_t buf;
+  memcpy(buf.buf, sql, length + 1);
+  buf.size = length;
+
+  statement_t statement;
+  switch (prepare_statement(&buf, &statement)) {
+    case PREPARE_SUCCESS:
+      break;
+    case PREPARE_SYTAX_ERROR:
+      return libdb_invalid(db, DB_SYNTAX_ERROR, "Syntax error. Cound not parse statement.");
+    case PREPARE_NEGATIVE_ID:
+      return libdb_invalid(db, DB_INVALID_ARGUMENT, "ID Must be positive.");
+    case PREPARE_STRING_TOO_LONG:
+      return libdb_invalid(db, DB_INVALID_ARGUMENT, "String is to long.");
+    case PREPARE_UNRECOGNIZED_STATEMENT:
+      snprintf(db->errmsg, DB_ERROR_MESSAGE_SIZE, "Unrecognized keyword at start of '%s'", sql);
+      return DB_SYNTAX_ERROR;
+  }
+
+  if (kind != NULL) {
+    if (statement.kind == STATEMENT_INSERT) {
+      *kind = DB_STATEMENT_INSERT;
+    } else {
+      *kind = statement.select_by_id ? DB_STATEMENT_SELECT_ID : DB_STATEMENT_SELECT;
+    }
+  }
+  return libdb_execute(db, &statement);
+}
+
+DbStatus libdb_get(libdb_t* db, uint64_t id, row_t* row) {
+  if (db == NULL || row == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  if (db->failed) {
+    return DB_IO_ERROR;
+  }
+
+  volatile DbStatus status = DB_NOT_FOUND;
+  table_lock(db->table);
+  db_error_trap_t trap;
+  LIBDB_TRY(trap) {
+    void* value = table_lookup(db->table, id);
+    if (value != NULL) {
+      deserialize_row(value, row);
+      status = DB_OK;
+    }
+    db_error_pop(&trap);
+  } else {
+    table_unlock(db->table);
+    return libdb_fail(db, &trap);
+  }
+  table_unlock(db->table);
+
+  return status;
+}
+
+DbStatus libdb_iter_open(libdb_t* db, libdb_iter_t** out) {
+  if (db == NULL || out == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  libdb_iter_t* iter = malloc(sizeof(libdb_iter_t));
+  iter->db = db;
+  iter->cursor.end_of_table = db_true;
+  *out = iter;
+  return DB_OK;
+}
+
+DbStatus libdb_iter_seek(libdb_iter_t* iter, uint64_t start_id) {
+  if (iter == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  libdb_t* db = iter->db;
+  iter->cursor.end_of_table = db_true;
+  if (db->failed) {
+    return DB_IO_ERROR;
+  }
+
+  table_lock(db->table);
+  db_error_trap_t trap;
+  LIBDB_TRY(trap) {
+    table_seek(db->table, start_id, &(iter->cursor));
+    db_error_pop(&trap);
+  } else {
+    table_unlock(db->table);
+    return libdb_fail(db, &trap);
+  }
+  table_unlock(db->table);
+
+  return DB_OK;
+}
+
+db_bool libdb_iter_valid(libdb_iter_t* iter) {
+  return iter != NULL && iter->db != NULL && !iter->db->failed && !iter->cursor.end_of_table;
+}
+
+DbStatus libdb_iter_row(libdb_iter_t* iter, row_view_t* row) {
+  if (row == NULL || !libdb_iter_valid(iter)) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  table_lock(iter->db->table);
+  db_error_trap_t trap;
+  LIBDB_TRY(trap) {
+    row_view(cursor_value(&(iter->cursor)), row);
+    db_error_pop(&trap);
+  } else {
+    table_unlock(iter->db->table);
+    return libdb_fail(iter->db, &trap);
+  }
+  table_unlock(iter->db->table);
+
+  return DB_OK;
+}
+
+DbStatus libdb_iter_next(libdb_iter_t* iter) {
+  if (!libdb_iter_valid(iter)) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  table_lock(iter->db->table);
+  db_error_trap_t trap;
+  LIBDB_TRY(trap) {
+    cursor_advance(&(iter->cursor));
+    db_error_pop(&trap);
+  } else {
+    table_unlock(iter->db->table);
+    return libdb_fail(iter->db, &trap);
+  }
+  table_unlock(iter->db->table);
+
+  return DB_OK;
+}
+
+void libdb_iter_close(libdb_iter_t* iter) {
+  free(iter);
+}
+
+const char* libdb_errmsg(libdb_t* db) {
+  if (db == NULL) {
+    return "invalid handle";
+  }
+  return db->errmsg;
+}
+
+const char* libdb_status_string(DbStatus status) {
+  switch (status) {
+    case DB_OK: return "ok";
+    case DB_NOT_FOUND: return "not found";
+    case DB_DUPLICATE_KEY: return "duplicate key";
+    case DB_TABLE_FULL: return "table full";
+    case DB_INVALID_ARGUMENT: return "invalid argument";
+    case DB_SYNTAX_ERROR: return "syntax error";
+    case DB_IO_ERROR: return "i/o error";
+  }
+  return "unknown status";
+}
+
+table_t* libdb_table(libdb_t* db) {
+  return db->table;
+}
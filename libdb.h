@@ -0,0 +1,71 @@
+#ifndef __LIBDB_H__
+#define __LIBDB_H__
+#include <stdint.h>
+#include "def.h"
+#include "row.h"
+#include "options.h"
+
+// ---------- embedding API -------------
+/*
+ * In-process interface to the engine. Calls never exit the process:
+ * engine errors come back as DB_IO_ERROR with the message available
+ * from libdb_errmsg(), after which the handle only accepts
+ * libdb_close(), which then skips writing back possibly torn pages.
+ * A handle must not be used from two threads at once.
+ */
+typedef enum {
+  DB_OK,
+  DB_NOT_FOUND,
+  DB_DUPLICATE_KEY,
+  DB_TABLE_FULL,
+  DB_INVALID_ARGUMENT,
+  DB_SYNTAX_ERROR,
+  DB_IO_ERROR
+} DbStatus;
+
+typedef enum {
+  DB_STATEMENT_INSERT,
+  DB_STATEMENT_SELECT,
+  DB_STATEMENT_SELECT_ID
+} DbStatementKind;
+
+typedef struct __libdb libdb_t;
+
+/*
+ * Range iterator over one handle, allocated by libdb_iter_open() and
+ * freed by libdb_iter_close(), before the handle is closed. Any insert
+ * invalidates open iterators; they can be seeked again.
+ */
+typedef struct __libdb_iter libdb_iter_t;
+
+DbStatus libdb_open(const char* filename, libdb_t** db);
+/* options may be NULL for the defaults; see db_options_init() */
+DbStatus libdb_open_with(const char* filename, const db_options_t* options, libdb_t** db);
+DbStatus libdb_close(libdb_t* db);
+
+DbStatus libdb_insert(libdb_t* db, uint64_t id, const char* username, const char* email);
+DbStatus libdb_get(libdb_t* db, uint64_t id, row_t* row);
+
+/*
+ * Run one statement of the db_exe shell: "insert ID USERNAME EMAIL",
+ * "select" or "select where id = ID". A select prints its rows to
+ * stdout. A statement that does not parse is DB_SYNTAX_ERROR, one with
+ * a bad value DB_INVALID_ARGUMENT, and libdb_errmsg() says why. kind,
+ * unless NULL, is set once the statement parsed.
+ */
+DbStatus libdb_exec(libdb_t* db, const char* sql, DbStatementKind* kind);
+
+/* A new iterator, positioned nowhere until seeked */
+DbStatus libdb_iter_open(libdb_t* db, libdb_iter_t** iter);
+/* Position iter at the first row with id >= start_id */
+DbStatus libdb_iter_seek(libdb_iter_t* iter, uint64_t start_id);
+db_bool libdb_iter_valid(libdb_iter_t* iter);
+/* The view points into the page cache and is valid until the next call */
+DbStatus libdb_iter_row(libdb_iter_t* iter, row_view_t* row);
+DbStatus libdb_iter_next(libdb_iter_t* iter);
+void libdb_iter_close(libdb_iter_t* iter);
+
+const char* libdb_errmsg(libdb_t* db);
+const char* libdb_status_string(DbStatus status);
+
+#endif
@@ -0,0 +1,175 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+/* A token holds 4 bits of each length; 15 means more bytes follow */
+#define LZ_RUN_MASK 15
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hash32(uint32_t value) {
+  return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* put_length(uint8_t* op, uint32_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+/*
+Write one sequence: literal_len literals, then a match of match_len
+bytes at offset back, or no match when match_len is 0 (the tail).
+Returns NULL when dst is full.
+*/
+static uint8_t* put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* literals,
+                             uint32_t literal_len, uint32_t offset, uint32_t match_len) {
+  size_t worst = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+  if (worst > (size_t)(oend - op)) {
+    return NULL;
+  }
+
+  uint32_t match_code = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+  uint8_t* token = op++;
+  *token = (literal_len < LZ_RUN_MASK ? literal_len : LZ_RUN_MASK) << 4 |
+           (match_code < LZ_RUN_MASK ? match_code : LZ_RUN_MASK);
+
+  if (literal_len >= LZ_RUN_MASK) {
+    op = put_length(op, literal_len - LZ_RUN_MASK);
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (match_len > 0) {
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (match_code >= LZ_RUN_MASK) {
+      op = put_length(op, match_code - LZ_RUN_MASK);
+    }
+  }
+  return op;
+}
+
+/*
+Greedy parse with a single-entry hash table of the last position each
+4-byte prefix was seen at. Candidates are verified, so stale entries
+only cost a miss.
+*/
+uint32_t lz_compress(const void* src, uint32_t src_size, void* dst, uint32_t dst_capacity) {
+  const uint8_t* base = src;
+  const uint8_t* ip = base;
+  const uint8_t* anchor = base;
+  const uint8_t* end = base + src_size;
+  uint8_t* op = dst;
+  uint8_t* oend = op + dst_capacity;
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  while (end - ip >= LZ_MIN_MATCH) {
+    uint32_t hash = hash32(read32(ip));
+    const uint8_t* ref = base + table[hash];
+    table[hash] = ip - base;
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+      ip++;
+      continue;
+    }
+
+    uint32_t match_len = LZ_MIN_MATCH;
+    while (ip + match_len < end && ref[match_len] == ip[match_len]) {
+      match_len++;
+    }
+
+    op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len);
+    if (op == NULL) {
+      return 0;
+    }
+    ip += match_len;
+    anchor = ip;
+  }
+
+  if (anchor < end) {
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (op == NULL) {
+      return 0;
+    }
+  }
+  return op - (uint8_t*)dst;
+}
+
+static db_bool get_length(const uint8_t** ip, const uint8_t* iend, uint32_t* length) {
+  uint8_t byte;
+  do {
+    if (*ip >= iend) {
+      return db_false;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return db_true;
+}
+
+/* Every length and offset is checked, so a torn or corrupt page cannot overrun dst */
+db_bool lz_decompress(const void* src, uint32_t src_size, void* dst, uint32_t dst_size) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = ip + src_size;
+  uint8_t* op = dst;
+  uint8_t* oend = op + dst_size;
+
+  while (op < oend) {
+    if (ip >= iend) {
+      return db_false;
+    }
+    uint8_t token = *ip++;
+
+    uint32_t literal_len = token >> 4;
+    if (literal_len == LZ_RUN_MASK && !get_length(&ip, iend, &literal_len)) {
+      return db_false;
+    }
+    if (literal_len > (size_t)(iend - ip) || literal_len > (size_t)(oend - op)) {
+      return db_false;
+    }
+    memcpy(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    if (op == oend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return db_false;
+    }
+    uint32_t offset = ip[0] | (uint32_t)ip[1] << 8;
+    ip += 2;
+    uint32_t match_len = token & LZ_RUN_MASK;
+    if (match_len == LZ_RUN_MASK && !get_length(&ip, iend, &match_len)) {
+      return db_false;
+    }
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst) ||
+        match_len > (size_t)(oend - op)) {
+      return db_false;
+    }
+
+    const uint8_t* ref = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, ref, match_len);
+    } else {
+      /* Overlapping copy repeats the last offset bytes, e.g. a run of zeros */
+      for (uint32_t i = 0; i < match_len; i++) {
+        op[i] = ref[i];
+      }
+    }
+    op += match_len;
+  }
+  return db_true;
+}
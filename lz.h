@@ -0,0 +1,19 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+#include <stdint.h>
+#include "def.h"
+
+// ---------- page codec -------------
+/*
+ * Small LZ77 codec in the LZ4 mould, for pages: byte-aligned sequences
+ * of a literal run followed by a back reference of up to 64 KiB. The
+ * stream does not record its own size; the caller knows how many
+ * bytes it decompresses to.
+ */
+
+/* Compressed size, or 0 if the result would not fit in dst_capacity */
+uint32_t lz_compress(const void* src, uint32_t src_size, void* dst, uint32_t dst_capacity);
+/* Decompress exactly dst_size bytes; db_false if src is malformed */
+db_bool lz_decompress(const void* src, uint32_t src_size, void* dst, uint32_t dst_size);
+
+#endif
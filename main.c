@@ -9,6 +9,9 @@
 #include "table.h"
 #include "tree.h"
 #include "db.h"
+#include "libdb.h"
+#include "trace.h"
+#include "stats.h"
 
 // ------- command line -------- 
 void readline_from_stdin(buf_t*);
@@ -16,24 +19,68 @@ void print_prompt();
 
 // ----------- sql -------------
 
+static TraceKind statement_trace_kind(DbStatementKind kind) {
+  switch (kind) {
+    case DB_STATEMENT_INSERT: return TRACE_INSERT;
+    case DB_STATEMENT_SELECT_ID: return TRACE_SELECT_ID;
+    case DB_STATEMENT_SELECT: break;
+  }
+  return TRACE_SELECT;
+}
+
 int main(int argc, char** argv) {
-  char* db_name;
+  char* db_name = DEFAULT_DB_NAME;
+  db_options_t options;
+  db_options_init(&options);
+  /* Log every statement that reaches the engine, for db_replay */
+  trace_t* capture = NULL;
 
-  if (argc < 2) {
-    db_name = DEFAULT_DB_NAME;
-  } else {
-    db_name = argv[1];
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      db_name = argv[i];
+    } else if (strncmp(argv[i], "--capture=", 10) == 0) {
+      capture = trace_create(argv[i] + 10);
+      if (capture == NULL) {
+        printf("Unable to create trace file %s\n", argv[i] + 10);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!db_options_parse_flag(&options, argv[i])) {
+      printf("usage: %s [--capture=TRACE] [options] [db file]\n", argv[0]);
+      db_options_usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  libdb_t* db;
+  if (libdb_open_with(db_name, &options, &db) != DB_OK) {
+    printf("%s\n", libdb_errmsg(db));
+    libdb_close(db);
+    exit(EXIT_FAILURE);
   }
 
   buf_t* read_buf = new_buf();
-  table_t* table = db_open(db_name);
+  /* Meta commands have no libdb call yet, so they go to the table */
+  table_t* table = libdb_table(db);
   while(1) {
     print_prompt();
     readline_from_stdin(read_buf);
 
+    if (strcmp(read_buf->buf, ".exit") == 0) {
+      db_bool ok = capture == NULL || trace_close(capture);
+      exit(libdb_close(db) == DB_OK && ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     if(read_buf->buf[0] == '.') {
-      switch(do_meta_command(read_buf, table)) {
+      uint64_t start = stats_now_ns();
+      table_lock(table);
+      MetaCommandResult meta_result = do_meta_command(read_buf, table);
+      table_unlock(table);
+      switch(meta_result) {
         case META_COMMAND_SUCCESS:
+          if (capture != NULL) {
+            trace_write(capture, TRACE_META, start, stats_now_ns() - start, read_buf->buf,
+                        read_buf->size);
+          }
           continue;
         case META_COMMAND_UNRICOGNIZED_COMMAND:
           printf("unrecognized meta command '%s'\n", read_buf->buf);
@@ -41,33 +88,35 @@ int main(int argc, char** argv) {
       }
     }
 
-    statement_t statement;
-    switch(prepare_statement(read_buf, &statement)) {
-      case PREPARE_SUCCESS: break;
-      case PREPARE_SYTAX_ERROR:
-        printf("Syntax error. Cound not parse statement.\n");
-        continue;
-      case PREPARE_NEGATIVE_ID: 
-        printf("ID Must be positive.\n");
-        continue;
-      case PREPARE_STRING_TOO_LONG:
-        printf("String is to long.\n");
-        continue;
-      case PREPARE_UNRECOGNIZED_STATEMENT:
-        printf("Unrecognized keyword at start of '%s'\n", read_buf->buf);
-        break;
-    }
-
-    switch(execute_statement(&statement, table)) {
-      case EXECUTE_SUCCESS:
+    uint64_t start = stats_now_ns();
+    DbStatementKind kind;
+    DbStatus status = libdb_exec(db, read_buf->buf, &kind);
+    uint64_t latency = stats_now_ns() - start;
+    switch(status) {
+      case DB_OK:
         printf("Executed.\n");
         break;
-      case EXECUTE_DUPLICATE_KEY:
+      case DB_DUPLICATE_KEY:
         printf("Error: Duplicate key.\n");
         break;
-      case EXECUTE_TABLE_FULL:
+      case DB_TABLE_FULL:
         printf("Error: Table full.\n");
         break;
+      case DB_SYNTAX_ERROR:
+      case DB_INVALID_ARGUMENT:
+        printf("%s\n", libdb_errmsg(db));
+        continue;
+      default:
+        printf("%s\n", libdb_errmsg(db));
+        if (capture != NULL) {
+          trace_close(capture);
+        }
+        libdb_close(db);
+        exit(EXIT_FAILURE);
+    }
+    if (capture != NULL) {
+      trace_write(capture, statement_trace_kind(kind), start, latency, read_buf->buf,
+                  read_buf->size);
     }
   }
   return 0;
@@ -0,0 +1,97 @@
+#include "memtable.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+/* Key and value sit back to back, exactly like a leaf cell */
+_Static_assert(offsetof(memtable_entry_t, value) ==
+               offsetof(memtable_entry_t, key) + sizeof(uint64_t),
+               "memtable entry must match the leaf cell layout");
+
+memtable_t* memtable_new(uint32_t capacity) {
+  memtable_t* memtable = calloc(1, sizeof(memtable_t));
+  memtable->capacity = capacity;
+  memtable->entries = malloc((size_t)capacity * sizeof(memtable_entry_t));
+  memtable->seed = 0x9e3779b97f4a7c15ULL;
+  memtable_clear(memtable);
+  return memtable;
+}
+
+void memtable_free(memtable_t* memtable) {
+  free(memtable->entries);
+  free(memtable);
+}
+
+void memtable_clear(memtable_t* memtable) {
+  memtable->count = 0;
+  memtable->height = 1;
+  memset(memtable->head.next, 0, sizeof(memtable->head.next));
+}
+
+/* Each level up keeps a quarter of the entries below it */
+static uint32_t random_height(memtable_t* memtable) {
+  uint64_t x = memtable->seed;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  memtable->seed = x;
+
+  uint32_t height = 1;
+  while (height < MEMTABLE_MAX_HEIGHT && (x & 3) == 0) {
+    height++;
+    x >>= 2;
+  }
+  return height;
+}
+
+/*
+Walk down from the top level. update[i] ends on the last entry at
+level i whose key is below key.
+*/
+static memtable_entry_t* find_greater_or_equal(memtable_t* memtable, uint64_t key,
+                                               memtable_entry_t** update) {
+  memtable_entry_t* entry = &(memtable->head);
+  for (int32_t level = memtable->height - 1; level >= 0; level--) {
+    while (entry->next[level] != NULL && entry->next[level]->key < key) {
+      entry = entry->next[level];
+    }
+    if (update != NULL) {
+      update[level] = entry;
+    }
+  }
+  return entry->next[0];
+}
+
+void memtable_put(memtable_t* memtable, uint64_t key, row_t* row) {
+  memtable_entry_t* update[MEMTABLE_MAX_HEIGHT];
+  find_greater_or_equal(memtable, key, update);
+
+  uint32_t height = random_height(memtable);
+  for (uint32_t level = memtable->height; level < height; level++) {
+    update[level] = &(memtable->head);
+  }
+  if (height > memtable->height) {
+    memtable->height = height;
+  }
+
+  memtable_entry_t* entry = &(memtable->entries[memtable->count++]);
+  entry->key = key;
+  serialize_row(row, entry->value);
+  for (uint32_t level = 0; level < height; level++) {
+    entry->next[level] = update[level]->next[level];
+    update[level]->next[level] = entry;
+  }
+}
+
+void* memtable_get(memtable_t* memtable, uint64_t key) {
+  memtable_entry_t* entry = find_greater_or_equal(memtable, key, NULL);
+  if (entry != NULL && entry->key == key) {
+    return entry->value;
+  }
+  return NULL;
+}
+
+memtable_entry_t* memtable_seek(memtable_t* memtable, uint64_t key) {
+  return find_greater_or_equal(memtable, key, NULL);
+}
@@ -0,0 +1,49 @@
+#ifndef __MEMTABLE_H__
+#define __MEMTABLE_H__
+#include <stdint.h>
+#include "def.h"
+#include "row.h"
+
+// ---------- write buffer -------------
+/*
+ * Sorted in-memory buffer of rows not yet in the tree: a skip list over
+ * a fixed pool of entries. Each entry holds its row as a leaf cell (key
+ * then serialized row) so a drain can copy it into a leaf as is.
+ */
+#define MEMTABLE_MAX_HEIGHT 12
+
+typedef struct __memtable_entry {
+  struct __memtable_entry* next[MEMTABLE_MAX_HEIGHT];
+  uint64_t key;
+  char value[ROW_SIZE];
+} memtable_entry_t;
+
+typedef struct {
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t height;
+  uint64_t seed;
+  memtable_entry_t head;
+  memtable_entry_t* entries;
+} memtable_t;
+
+memtable_t* memtable_new(uint32_t capacity);
+void memtable_free(memtable_t* memtable);
+void memtable_clear(memtable_t* memtable);
+
+/* The caller checks the key is absent and the buffer is not full */
+void memtable_put(memtable_t* memtable, uint64_t key, row_t* row);
+/* Serialized row stored under key, or NULL */
+void* memtable_get(memtable_t* memtable, uint64_t key);
+/* First entry with a key >= key, or NULL */
+memtable_entry_t* memtable_seek(memtable_t* memtable, uint64_t key);
+
+static inline memtable_entry_t* memtable_next(memtable_entry_t* entry) {
+  return entry->next[0];
+}
+
+static inline db_bool memtable_full(memtable_t* memtable) {
+  return memtable->count >= memtable->capacity;
+}
+
+#endif
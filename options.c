@@ -0,0 +1,110 @@
+#include "options.h"
+#include "header.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CHECKPOINT_DIRTY_RATIO 0.1
+
+/* Value of "--name=value" if arg is that flag, else NULL */
+static const char* flag_value(const char* arg, const char* name) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return NULL;
+  }
+  return arg + len + 1;
+}
+
+void db_options_init(db_options_t* options) {
+  options->page_size = DEFAULT_PAGE_SIZE;
+  options->compress = db_false;
+  options->huge_pages = db_false;
+  options->direct_io = db_false;
+  options->checkpoint_interval_ms = 0;
+  options->checkpoint_dirty_ratio = DEFAULT_CHECKPOINT_DIRTY_RATIO;
+  options->write_buffer_rows = 0;
+  options->bloom_filter = db_false;
+  options->hash_index = db_false;
+  options->warm_restart = db_false;
+}
+
+db_bool db_options_parse_flag(db_options_t* options, const char* arg) {
+  if (strcmp(arg, "--compress") == 0) {
+    options->compress = db_true;
+    return db_true;
+  }
+  if (strcmp(arg, "--huge-pages") == 0) {
+    options->huge_pages = db_true;
+    return db_true;
+  }
+  if (strcmp(arg, "--direct-io") == 0) {
+    options->direct_io = db_true;
+    return db_true;
+  }
+  if (strcmp(arg, "--bloom") == 0) {
+    options->bloom_filter = db_true;
+    return db_true;
+  }
+  if (strcmp(arg, "--hash-index") == 0) {
+    options->hash_index = db_true;
+    return db_true;
+  }
+  if (strcmp(arg, "--warm-restart") == 0) {
+    options->warm_restart = db_true;
+    return db_true;
+  }
+
+  const char* value;
+  char* end;
+  if ((value = flag_value(arg, "--page-size")) != NULL) {
+    unsigned long page_size = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || page_size > UINT32_MAX ||
+        !header_valid_page_size(page_size)) {
+      return db_false;
+    }
+    options->page_size = page_size;
+    return db_true;
+  }
+  if ((value = flag_value(arg, "--checkpoint-interval")) != NULL) {
+    unsigned long interval = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || interval > UINT32_MAX) {
+      return db_false;
+    }
+    options->checkpoint_interval_ms = interval;
+    return db_true;
+  }
+  if ((value = flag_value(arg, "--checkpoint-dirty-ratio")) != NULL) {
+    double ratio = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || ratio < 0 || ratio > 1) {
+      return db_false;
+    }
+    options->checkpoint_dirty_ratio = ratio;
+    return db_true;
+  }
+  if ((value = flag_value(arg, "--write-buffer")) != NULL) {
+    unsigned long rows = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || rows > UINT32_MAX) {
+      return db_false;
+    }
+    options->write_buffer_rows = rows;
+    return db_true;
+  }
+  return db_false;
+}
+
+void db_options_usage() {
+  printf("  --page-size=BYTES     page size of a new db file, 4096 to 65536\n");
+  printf("  --compress            store the pages of a new db file compressed\n");
+  printf("  --huge-pages          back the page cache with huge pages\n");
+  printf("  --direct-io           bypass the kernel page cache (O_DIRECT)\n");
+  printf("  --checkpoint-interval=MS\n"
+         "                        flush dirty pages in the background every MS ms\n");
+  printf("  --checkpoint-dirty-ratio=R\n"
+         "                        only when at least R (0..1) of the pages are dirty\n");
+  printf("  --write-buffer=ROWS   buffer up to ROWS inserts in memory, sorted,\n"
+         "                        and move them into the tree in key order\n");
+  printf("  --bloom               keep a Bloom filter of the keys in <db>.bloom\n");
+  printf("  --hash-index          index ids to leaves in <db>.hidx for point lookups\n");
+  printf("  --warm-restart        save the resident pages in <db>.warm, prefetch them on open\n");
+}
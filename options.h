@@ -0,0 +1,37 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+#include "def.h"
+
+// ---------- options -------------
+typedef struct {
+  /* Page size for a new db file; existing files keep theirs */
+  uint32_t page_size;
+  /* Store the pages of a new db file compressed; not with direct_io */
+  db_bool compress;
+  /* Back the page frame arena with huge pages, falling back to THP */
+  db_bool huge_pages;
+  /* Open the db file with O_DIRECT so pages are only cached by the engine */
+  db_bool direct_io;
+  /* Wake the background checkpointer this often; 0 leaves all writes to close */
+  uint32_t checkpoint_interval_ms;
+  /* Checkpoint once this fraction of the pages is dirty */
+  double checkpoint_dirty_ratio;
+  /* Rows held in the sorted write buffer before draining; 0 disables it */
+  uint32_t write_buffer_rows;
+  /* Keep a Bloom filter over the keys in <db>.bloom to skip tree probes for absent keys */
+  db_bool bloom_filter;
+  /* Keep a hash index from id to leaf in <db>.hidx for point lookups */
+  db_bool hash_index;
+  /* Remember the resident pages in <db>.warm and prefetch them on the next open */
+  db_bool warm_restart;
+} db_options_t;
+
+void db_options_init(db_options_t* options);
+/*
+ * Apply one "--name[=value]" command line flag.
+ * Returns db_false if the flag is not an engine option.
+ */
+db_bool db_options_parse_flag(db_options_t* options, const char* arg);
+void db_options_usage();
+
+#endif
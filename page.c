@@ -1,59 +1,220 @@
+/* O_DIRECT */
+#define _GNU_SOURCE
 #include "page.h"
+#include "error.h"
+#include "stats.h"
+#include "lz.h"
 
-#include "stdlib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
 
-page_t* page_open(const char* filename) {
-  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+/*
+Reserve address space for every frame up front. Anonymous memory is
+only committed as pages are touched, so the reservation is cheap.
+Explicit huge pages need a reserved pool and fail fast without one;
+then transparent huge pages are requested instead.
+*/
+static void* arena_map(size_t size, db_bool huge_pages) {
+  void* arena = MAP_FAILED;
+  if (huge_pages) {
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (arena == MAP_FAILED) {
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+      return NULL;
+    }
+    if (huge_pages) {
+      madvise(arena, size, MADV_HUGEPAGE);
+    }
+  }
+  return arena;
+}
+
+/* Pages page_flush_dirty() compresses and writes per batch */
+#define PAGE_FLUSH_BATCH 64
+
+static uint32_t extent_align(uint32_t length) {
+  return (length + PAGE_EXTENT_ALIGN - 1) / PAGE_EXTENT_ALIGN * PAGE_EXTENT_ALIGN;
+}
+
+/*
+Load the extent map of a compressed file. A page exists once it has an
+extent; page 0 exists as soon as the file is not empty. Appends start
+past the map even when nothing has been written yet.
+*/
+static void map_open(page_t* pager) {
+  pager->map = calloc(TABLE_MAX_PAGES, sizeof(page_extent_t));
+  pager->read_buffer = malloc(pager->page_size);
+  pager->write_buffer = malloc(PAGE_STAGING_SIZE(pager->page_size, PAGE_FLUSH_BATCH));
+  pager->map_dirty_first = TABLE_MAX_PAGES;
+  pager->map_dirty_end = 0;
+
+  pager->num_pages = pager->file_length > 0 ? 1 : 0;
+  if (pread(pager->file_descriptor, pager->map, PAGE_MAP_SIZE, pager->page_size) == -1) {
+    db_fatal("Error reading extent map");
+  }
+  for (uint32_t i = 1; i < TABLE_MAX_PAGES; i++) {
+    page_extent_t* extent = &(pager->map[i]);
+    if (extent->offset == 0) {
+      continue;
+    }
+    if (extent->length > pager->page_size ||
+        (uint64_t)extent->offset + extent->length > pager->file_length) {
+      db_fatal("Extent of page %d is out of bounds. Corrupt file.", i);
+    }
+    pager->num_pages = i + 1;
+  }
+
+  uint32_t data_start = pager->page_size + PAGE_MAP_SIZE;
+  if (pager->file_length < data_start) {
+    pager->file_length = data_start;
+  }
+}
+
+static void map_mark_dirty(page_t* pager, uint32_t page_num) {
+  if (page_num < pager->map_dirty_first) {
+    pager->map_dirty_first = page_num;
+  }
+  if (page_num + 1 > pager->map_dirty_end) {
+    pager->map_dirty_end = page_num + 1;
+  }
+}
+
+/*
+With direct I/O the kernel page cache is bypassed and the arena is the
+only copy of a page. O_DIRECT needs buffers, offsets and lengths aligned
+to the device block size; frames are page_size aligned and sized, and
+page sizes start at 4096, which covers 512 and 4096 byte sectors.
+*/
+page_t* page_open(const char* filename, const db_options_t* options, uint32_t page_size,
+                  db_bool compressed) {
+  /* Extents are neither block aligned nor block sized */
+  if (compressed && options->direct_io) {
+    db_fatal("Compressed db files cannot use direct I/O.");
+  }
+
+  int flags = O_RDWR | O_CREAT;
+  if (options->direct_io) {
+    flags |= O_DIRECT;
+  }
+  int fd = open(filename, flags, S_IWUSR | S_IRUSR);
 
   if ( fd == -1 ) {
-    printf("Unable to open file.\n");
-    exit(EXIT_FAILURE);
+    if (options->direct_io && errno == EINVAL) {
+      db_fatal("Filesystem does not support direct I/O (O_DIRECT).");
+    }
+    db_fatal("Unable to open file.");
   }
 
   off_t file_length = lseek(fd, 0 , SEEK_END);
 
+  if (!compressed && file_length % page_size != 0) {
+    close(fd);
+    db_fatal("Db file is not a whole number of pages. Corrupt file.");
+  }
+
   page_t* pager = malloc(sizeof(page_t));
+  pager->arena_size = (size_t)TABLE_MAX_PAGES * page_size;
+  pager->arena = arena_map(pager->arena_size, options->huge_pages);
+  if (pager->arena == NULL) {
+    free(pager);
+    close(fd);
+    db_fatal("Unable to map page cache.");
+  }
+
+  pager->filename = strdup(filename);
+  pager->options = *options;
+  pager->page_size = page_size;
   pager->file_descriptor = fd;
   pager->file_length = file_length;
-  pager->num_pages = file_length / PAGE_SIZE;
-
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+  pager->num_pages = file_length / page_size;
+  pager->compressed = compressed;
+  pager->map = NULL;
+  pager->read_buffer = NULL;
+  pager->write_buffer = NULL;
+  pager->snapshot = NULL;
+  if (compressed) {
+    /* A corrupt map must not leak the descriptor and the arena */
+    db_error_trap_t trap;
+    db_error_push(&trap);
+    if (setjmp(trap.env) == 0) {
+      map_open(pager);
+      db_error_pop(&trap);
+    } else {
+      page_discard(pager);
+      db_fatal("%s", trap.message);
+    }
   }
 
   for (uint32_t i=0; i<TABLE_MAX_PAGES; i++) {
     pager->pages[i] = NULL;
   }
+  memset(pager->dirty, 0, sizeof(pager->dirty));
+  pager->num_dirty = 0;
 
   return pager;
 }
 
+/* Page 0 is always raw at the start of the file */
+static void page_read_compressed(page_t* pager, uint32_t page_num, void* page) {
+  off_t offset = 0;
+  uint32_t length = pager->page_size;
+  if (page_num != 0) {
+    if (pager->map[page_num].offset == 0) {
+      return;
+    }
+    offset = pager->map[page_num].offset;
+    length = pager->map[page_num].length;
+  }
+
+  void* image = length == pager->page_size ? page : pager->read_buffer;
+  ssize_t bytes_read = pread(pager->file_descriptor, image, length, offset);
+  if (bytes_read == -1) {
+    db_fatal("Error reading file");
+  }
+  STATS_INC(STATS_DISK_READS);
+  STATS_ADD(STATS_BYTES_READ, bytes_read);
+
+  if (image != page &&
+      (bytes_read != length || !lz_decompress(image, length, page, pager->page_size))) {
+    db_fatal("Compressed page %d is corrupt.", page_num);
+  }
+}
+
 void* get_page(page_t* pager, uint32_t page_num) {
-  if(page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d", page_num, TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+  if(page_num >= TABLE_MAX_PAGES) {
+    db_fatal("Tried to fetch page number out of bounds. %d > %d", page_num, TABLE_MAX_PAGES);
   }
 
   if (pager->pages[page_num] == NULL) {
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+    STATS_INC(STATS_CACHE_MISSES);
+    void* page = pager->arena + (size_t)page_num * pager->page_size;
+    uint32_t num_pages = pager->file_length / pager->page_size;
 
-    if (pager->file_length % PAGE_SIZE) {
+    if (pager->file_length % pager->page_size) {
       num_pages += 1;
     }
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+    if (pager->compressed) {
+      page_read_compressed(pager, page_num, page);
+    } else if (page_num < num_pages) {
+      ssize_t bytes_read = pread(pager->file_descriptor, page, pager->page_size,
+                                 (off_t)page_num * pager->page_size);
       if (bytes_read == -1) {
-        printf("Error reading file \n");
-        exit(EXIT_FAILURE);
+        db_fatal("Error reading file");
       }
+      STATS_INC(STATS_DISK_READS);
+      STATS_ADD(STATS_BYTES_READ, bytes_read);
     }
 
     pager->pages[page_num] = page;
@@ -61,28 +222,338 @@ void* get_page(page_t* pager, uint32_t page_num) {
     if (page_num >= pager->num_pages) {
       pager->num_pages = page_num + 1;
     }
+  } else {
+    STATS_INC(STATS_CACHE_HITS);
   }
 
   return pager->pages[page_num];
 }
 
+void* get_page_for_write(page_t* pager, uint32_t page_num) {
+  void* page = get_page(pager, page_num);
+  page_mark_dirty(pager, page_num);
+  return page;
+}
+
+/* Called before every change to a frame, dirty or not */
+static void snapshot_keep(page_snapshot_t* snapshot, page_t* pager, uint32_t page_num) {
+  if (page_num >= snapshot->num_pages || snapshot->kept[page_num] != NULL ||
+      pager->pages[page_num] == NULL ||
+      (snapshot->done[page_num / 64] >> (page_num % 64)) & 1) {
+    return;
+  }
+  snapshot->kept[page_num] = malloc(pager->page_size);
+  memcpy(snapshot->kept[page_num], pager->pages[page_num], pager->page_size);
+  snapshot->num_kept++;
+}
+
+void page_mark_dirty(page_t* pager, uint32_t page_num) {
+  if (pager->snapshot != NULL) {
+    snapshot_keep(pager->snapshot, pager, page_num);
+  }
+  uint64_t bit = 1ULL << (page_num % 64);
+  if (!(pager->dirty[page_num / 64] & bit)) {
+    pager->dirty[page_num / 64] |= bit;
+    pager->num_dirty++;
+  }
+}
+
+db_bool page_is_dirty(page_t* pager, uint32_t page_num) {
+  return (pager->dirty[page_num / 64] >> (page_num % 64)) & 1;
+}
+
+/* A frame the foreground already loaded may be newer than image */
+db_bool page_install(page_t* pager, uint32_t page_num, const void* image) {
+  if (pager->pages[page_num] != NULL) {
+    return db_false;
+  }
+  void* page = pager->arena + (size_t)page_num * pager->page_size;
+  memcpy(page, image, pager->page_size);
+  pager->pages[page_num] = page;
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
+  }
+  return db_true;
+}
+
+static void page_clear_dirty(page_t* pager, uint32_t page_num) {
+  uint64_t bit = 1ULL << (page_num % 64);
+  if (pager->dirty[page_num / 64] & bit) {
+    pager->dirty[page_num / 64] &= ~bit;
+    pager->num_dirty--;
+  }
+}
+
+static db_bool write_fully(int fd, const char* data, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t bytes_written = pwrite(fd, data, length, offset);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return db_false;
+    }
+    data += bytes_written;
+    offset += bytes_written;
+    length -= bytes_written;
+  }
+  return db_true;
+}
+
+/* Write the count pages starting at first, which are contiguous in the arena */
+static void page_write_run(page_t* pager, uint32_t first, uint32_t count) {
+  size_t length = (size_t)count * pager->page_size;
+  off_t offset = (off_t)first * pager->page_size;
+  if (!write_fully(pager->file_descriptor, pager->pages[first], length, offset)) {
+    db_fatal("Error writing");
+  }
+
+  STATS_ADD(STATS_DISK_WRITES, count);
+  STATS_ADD(STATS_BYTES_WRITTEN, (uint64_t)count * pager->page_size);
+
+  uint64_t end = (uint64_t)(first + count) * pager->page_size;
+  if (end > pager->file_length) {
+    pager->file_length = end;
+  }
+  for (uint32_t i = first; i < first + count; i++) {
+    page_clear_dirty(pager, i);
+  }
+}
+
+/*
+Copy the image of page_num to data and fill in its write. Compressed
+images are padded to whole extent units so that appended neighbours
+still go out as one write.
+*/
+static void stage_page(page_t* pager, uint32_t page_num, char* data, page_write_t* write) {
+  write->page_num = page_num;
+  write->offset = (off_t)page_num * pager->page_size;
+  write->length = pager->page_size;
+
+  uint32_t length = 0;
+  if (pager->compressed && page_num != 0) {
+    length = lz_compress(pager->pages[page_num], pager->page_size, data, pager->page_size - 1);
+  }
+  if (length == 0) {
+    memcpy(data, pager->pages[page_num], pager->page_size);
+    length = pager->page_size;
+  }
+  if (!pager->compressed || page_num == 0) {
+    return;
+  }
+
+  page_extent_t* extent = &(pager->map[page_num]);
+  uint32_t extent_size = extent_align(length);
+  if (extent->offset == 0 || extent_size > extent_align(extent->length)) {
+    if ((uint64_t)pager->file_length + extent_size > UINT32_MAX) {
+      db_fatal("Compressed db file is out of space; compact it.");
+    }
+    extent->offset = pager->file_length;
+    pager->file_length += extent_size;
+  }
+  extent->length = length;
+  map_mark_dirty(pager, page_num);
+
+  memset(data + length, 0, extent_size - length);
+  write->offset = extent->offset;
+  write->length = extent_size;
+}
+
+/* Stage the map entries changed since the last call; returns the number of writes */
+static uint32_t stage_map(page_t* pager, char* data, page_write_t* write) {
+  if (pager->map_dirty_first >= pager->map_dirty_end) {
+    return 0;
+  }
+  size_t length = (size_t)(pager->map_dirty_end - pager->map_dirty_first) * sizeof(page_extent_t);
+  memcpy(data, &(pager->map[pager->map_dirty_first]), length);
+  write->page_num = PAGE_MAP_WRITE;
+  write->offset = pager->page_size + (off_t)pager->map_dirty_first * sizeof(page_extent_t);
+  write->length = length;
+
+  pager->map_dirty_first = TABLE_MAX_PAGES;
+  pager->map_dirty_end = 0;
+  return 1;
+}
+
 void page_flush(page_t* pager, uint32_t page_num) {
   if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+    db_fatal("Tried to flush null page");
+  }
+
+  if (!pager->compressed) {
+    page_write_run(pager, page_num, 1);
+    return;
+  }
+
+  page_write_t writes[2];
+  stage_page(pager, page_num, pager->write_buffer, &writes[0]);
+  uint32_t count = 1 + stage_map(pager, (char*)pager->write_buffer + writes[0].length, &writes[1]);
+  if (!page_write_staged(pager->file_descriptor, pager->write_buffer, writes, count)) {
+    db_fatal("Error writing");
   }
+  page_clear_dirty(pager, page_num);
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+/* Extents first, then the map that points at them */
+static void page_flush_compressed(page_t* pager) {
+  page_write_t writes[PAGE_FLUSH_BATCH + 1];
+  uint32_t page_num = 0;
+  while (1) {
+    uint32_t count = page_stage_dirty(pager, page_num, PAGE_FLUSH_BATCH, pager->write_buffer,
+                                      writes);
+    if (count == 0) {
+      return;
+    }
+    if (!page_write_staged(pager->file_descriptor, pager->write_buffer, writes, count)) {
+      db_fatal("Error writing");
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      if (writes[i].page_num != PAGE_MAP_WRITE) {
+        page_num = writes[i].page_num + 1;
+      }
+    }
+  }
+}
 
-  if (offset == -1) {
-    printf("Error seeking.\n");
-    exit(EXIT_FAILURE);
+/*
+The write-back policy: pages are only written when dirty, and only
+here or by page_flush(). Frames for consecutive page numbers are
+consecutive in the arena, so a run of dirty pages goes out as a
+single write.
+*/
+void page_flush_dirty(page_t* pager) {
+  if (pager->compressed) {
+    page_flush_compressed(pager);
+    if (pager->num_dirty > 0) {
+      db_fatal("Tried to flush null page");
+    }
+    return;
   }
 
-  ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+  uint32_t page_num = 0;
+  while (pager->num_dirty > 0 && page_num < pager->num_pages) {
+    if (!page_is_dirty(pager, page_num)) {
+      page_num++;
+      continue;
+    }
 
-  if (bytes_written == -1) {
-    printf("Error writing\n");
-    exit(EXIT_FAILURE);
+    uint32_t first = page_num;
+    while (page_num < pager->num_pages && page_is_dirty(pager, page_num) &&
+           pager->pages[page_num] != NULL) {
+      page_num++;
+    }
+    if (page_num == first) {
+      db_fatal("Tried to flush null page");
+    }
+    page_write_run(pager, first, page_num - first);
   }
-}
\ No newline at end of file
+}
+
+uint32_t page_stage_dirty(page_t* pager, uint32_t first, uint32_t max,
+                          void* staging, page_write_t* writes) {
+  char* data = staging;
+  uint32_t count = 0;
+  for (uint32_t page_num = first;
+       count < max && pager->num_dirty > 0 && page_num < pager->num_pages; page_num++) {
+    if (!page_is_dirty(pager, page_num) || pager->pages[page_num] == NULL) {
+      continue;
+    }
+    stage_page(pager, page_num, data, &writes[count]);
+    data += writes[count].length;
+    count++;
+    page_clear_dirty(pager, page_num);
+  }
+  if (pager->compressed) {
+    count += stage_map(pager, data, &writes[count]);
+  }
+  return count;
+}
+
+/* Staged data is packed in write order, so only the file offsets need checking */
+db_bool page_write_staged(int fd, const void* staging, const page_write_t* writes,
+                          uint32_t count) {
+  const char* data = staging;
+  uint32_t i = 0;
+  while (i < count) {
+    off_t offset = writes[i].offset;
+    size_t length = writes[i].length;
+    uint32_t run = 1;
+    while (i + run < count && writes[i + run].offset == offset + (off_t)length) {
+      length += writes[i + run].length;
+      run++;
+    }
+
+    if (!write_fully(fd, data, length, offset)) {
+      return db_false;
+    }
+    STATS_ADD(STATS_DISK_WRITES, run);
+    STATS_ADD(STATS_BYTES_WRITTEN, length);
+    data += length;
+    i += run;
+  }
+  return db_true;
+}
+
+/*
+O_DIRECT skips the page cache but not the device cache, and says
+nothing about the metadata of a file that grew; sync for both.
+*/
+void page_sync(page_t* pager) {
+  if (fdatasync(pager->file_descriptor) == -1) {
+    db_fatal("Error syncing db file.");
+  }
+}
+
+void page_snapshot_begin(page_t* pager) {
+  pager->snapshot = calloc(1, sizeof(page_snapshot_t));
+  pager->snapshot->num_pages = pager->num_pages;
+}
+
+void* page_snapshot_take(page_t* pager, uint32_t page_num) {
+  page_snapshot_t* snapshot = pager->snapshot;
+  snapshot->done[page_num / 64] |= 1ULL << (page_num % 64);
+  void* kept = snapshot->kept[page_num];
+  if (kept != NULL) {
+    snapshot->kept[page_num] = NULL;
+    snapshot->num_kept--;
+  }
+  return kept;
+}
+
+void page_snapshot_end(page_t* pager) {
+  page_snapshot_t* snapshot = pager->snapshot;
+  if (snapshot == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < snapshot->num_pages && snapshot->num_kept > 0; i++) {
+    if (snapshot->kept[i] != NULL) {
+      free(snapshot->kept[i]);
+      snapshot->num_kept--;
+    }
+  }
+  free(snapshot);
+  pager->snapshot = NULL;
+}
+
+static void page_release(page_t* pager) {
+  page_snapshot_end(pager);
+  munmap(pager->arena, pager->arena_size);
+  free(pager->map);
+  free(pager->read_buffer);
+  free(pager->write_buffer);
+  free(pager->filename);
+  free(pager);
+}
+
+void page_close(page_t* pager) {
+  int result = close(pager->file_descriptor);
+  page_release(pager);
+  if (result == -1) {
+    db_fatal("Error closing db file.");
+  }
+}
+
+void page_discard(page_t* pager) {
+  close(pager->file_descriptor);
+  page_release(pager);
+}
@@ -1,21 +1,121 @@
 #ifndef __PAGE_H__
 #define __PAGE_H__
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "def.h"
+#include "options.h"
 
-#define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 100
-#define ROWS_PER_PAGE (PAGE_SIZE / ROW_SIZE)
-#define TABLE_MAX_ROWS (ROWS_PER_PAGE * TABLE_MAX_PAGES)
+/* Page size is chosen per file; any power of two in this range */
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+#define TABLE_MAX_PAGES 16384
+
+/*
+ * Compressed files keep page 0 raw at offset 0, followed by the extent
+ * map: for every page, where its compressed image lives and how long
+ * it is. Images go back to their old extent when they still fit in it
+ * and are appended otherwise; the space they leave behind is only
+ * reclaimed by compaction. An image as long as the page is stored raw.
+ */
+#define PAGE_EXTENT_ALIGN 128
+#define PAGE_MAP_SIZE (TABLE_MAX_PAGES * sizeof(page_extent_t))
+/* Staging space for max pages plus the map entries they may change */
+#define PAGE_STAGING_SIZE(page_size, max) ((size_t)(max) * (page_size) + PAGE_MAP_SIZE)
+/* page_num of the staged write that carries the extent map */
+#define PAGE_MAP_WRITE UINT32_MAX
+
+typedef struct {
+  /* 0 for a page that was never written */
+  uint32_t offset;
+  uint32_t length;
+} page_extent_t;
+
+/* One staged write of length bytes to offset; the data follows the previous write's */
+typedef struct {
+  uint32_t page_num;
+  uint32_t length;
+  off_t offset;
+} page_write_t;
+
+/*
+ * Copy-on-write view of pages [0, num_pages) as they were when the
+ * snapshot began, for a reader copying them outside the table lock.
+ * Until the reader is done with a page, the first change to it keeps
+ * the frame as it was aside. A page that was never kept is still what
+ * it was at the start: in the cache if dirty, otherwise on disk.
+ */
+typedef struct {
+  uint32_t num_pages;
+  uint64_t done[TABLE_MAX_PAGES / 64];
+  /* Frames kept aside, NULL until the page changes */
+  void* kept[TABLE_MAX_PAGES];
+  uint32_t num_kept;
+} page_snapshot_t;
 
 typedef struct {
+  char* filename;
+  db_options_t options;
+  uint32_t page_size;
   int file_descriptor;
   uint32_t file_length;
   uint32_t num_pages;
+  /* One mapping holds every frame: page n always lives at arena + n * page_size */
+  void* arena;
+  size_t arena_size;
+  /* Resident frames, NULL until the page is first loaded */
   void* pages[TABLE_MAX_PAGES];
+  /* Frames changed since they were last written, one bit per page */
+  uint64_t dirty[TABLE_MAX_PAGES / 64];
+  uint32_t num_dirty;
+  /* Only for compressed files */
+  db_bool compressed;
+  page_extent_t* map;
+  /* Map entries [map_dirty_first, map_dirty_end) are not on disk yet */
+  uint32_t map_dirty_first;
+  uint32_t map_dirty_end;
+  /* Scratch for one compressed image on read, and for page_flush_dirty() */
+  void* read_buffer;
+  void* write_buffer;
+  /* At most one, while a backup runs */
+  page_snapshot_t* snapshot;
 } page_t;
 
 void* get_page(page_t*, uint32_t page_num);
-page_t* page_open(const char* filename);
+/* get_page() for a caller about to modify the frame: marks it dirty */
+void* get_page_for_write(page_t* pager, uint32_t page_num);
+void page_mark_dirty(page_t* pager, uint32_t page_num);
+db_bool page_is_dirty(page_t* pager, uint32_t page_num);
+/* Load a frame from an image read elsewhere; db_false if it is already resident */
+db_bool page_install(page_t* pager, uint32_t page_num, const void* image);
+page_t* page_open(const char* filename, const db_options_t* options, uint32_t page_size,
+                  db_bool compressed);
+/* Write one page and clear its dirty bit */
 void page_flush(page_t* pager, uint32_t page_num);
+/* Write every dirty page in page order, merging adjacent pages into one call */
+void page_flush_dirty(page_t* pager);
+void page_sync(page_t* pager);
+/*
+ * Copy up to max dirty pages numbered first or above into staging, in
+ * page order, and mark them clean. Compressed images get their extents
+ * here, and the map entries that changed are staged after the pages.
+ * staging needs PAGE_STAGING_SIZE() bytes and writes room for max + 1.
+ * Returns the number of writes.
+ */
+uint32_t page_stage_dirty(page_t* pager, uint32_t first, uint32_t max,
+                          void* staging, page_write_t* writes);
+/* Issue staged writes to fd, merging adjacent ones; db_false on an I/O error */
+db_bool page_write_staged(int fd, const void* staging, const page_write_t* writes,
+                          uint32_t count);
+/* Start a snapshot of the pages there are now; the reader must not trust the file while a write is in flight */
+void page_snapshot_begin(page_t* pager);
+/* The reader is done with page_num: returns its kept frame, for the caller to free, or NULL */
+void* page_snapshot_take(page_t* pager, uint32_t page_num);
+void page_snapshot_end(page_t* pager);
+/* Close the file and release the frames; dirty pages must be flushed first */
+void page_close(page_t* pager);
+/* Same, but for a pager being thrown away: nothing is written or checked */
+void page_discard(page_t* pager);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libdb.h"
+#include "db.h"
+#include "trace.h"
+#include "stats.h"
+
+// ------------ db_replay -------------
+/*
+ * Re-executes a trace captured with `db_exe --capture=TRACE`, e.g.
+ *   db_replay --trace=prod.trace --db=copy.db
+ * Statements run back to back unless --paced, which starts each one at
+ * its recorded offset (divided by --speed). Replay against a copy of
+ * the db as it was when the capture started, or inserts will collide.
+ * Query output is discarded; the report puts replayed latency per
+ * statement kind next to what was recorded.
+ */
+#define DEFAULT_REPLAY_DB ".replay.db"
+
+typedef struct {
+  const char* trace_name;
+  const char* db_name;
+  db_bool paced;
+  double speed;
+  db_bool json;
+  db_options_t db_options;
+} replay_options_t;
+
+typedef struct {
+  uint64_t statements;
+  uint64_t skipped;
+  uint64_t failed;
+  uint64_t elapsed_ns;
+  stats_histogram_t replayed[TRACE_KIND_COUNT];
+  stats_histogram_t recorded[TRACE_KIND_COUNT];
+} replay_run_t;
+
+static void sleep_until(uint64_t deadline_ns) {
+  struct timespec ts;
+  ts.tv_sec = deadline_ns / 1000000000ULL;
+  ts.tv_nsec = deadline_ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+/* db_false if the statement no longer parses, e.g. a trace from a newer REPL */
+static db_bool replay_record(table_t* table, trace_record_t* record, ExecuteResult* result) {
+  *result = EXECUTE_SUCCESS;
+  if (record->kind == TRACE_META) {
+    return do_meta_command(&(record->text), table) == META_COMMAND_SUCCESS;
+  }
+
+  statement_t statement;
+  if (prepare_statement(&(record->text), &statement) != PREPARE_SUCCESS) {
+    return db_false;
+  }
+  *result = execute_statement(&statement, table);
+  return db_true;
+}
+
+/* Returns db_false on a corrupt trace; what was read before it still counts */
+static db_bool replay(replay_options_t* options, trace_t* trace, table_t* table,
+                      replay_run_t* run) {
+  trace_record_t* record = malloc(sizeof(trace_record_t));
+  TraceReadResult read_result;
+  uint64_t start = stats_now_ns();
+
+  while ((read_result = trace_read(trace, record)) == TRACE_RECORD) {
+    if (options->paced) {
+      sleep_until(start + (uint64_t)(record->offset_ns / options->speed));
+    }
+
+    uint64_t op_start = stats_now_ns();
+    table_lock(table);
+    ExecuteResult result;
+    db_bool ran = replay_record(table, record, &result);
+    table_unlock(table);
+    uint64_t latency = stats_now_ns() - op_start;
+
+    if (!ran) {
+      run->skipped++;
+      continue;
+    }
+    run->statements++;
+    run->failed += result != EXECUTE_SUCCESS;
+    stats_histogram_record(&(run->replayed[record->kind]), latency);
+    stats_histogram_record(&(run->recorded[record->kind]), record->latency_ns);
+  }
+
+  run->elapsed_ns = stats_now_ns() - start;
+  free(record);
+  return read_result == TRACE_EOF;
+}
+
+static void report(replay_options_t* options, replay_run_t* run) {
+  double seconds = run->elapsed_ns / 1e9;
+  double per_sec = seconds > 0 ? run->statements / seconds : 0;
+
+  if (options->json) {
+    printf("{\"statements\":%lu,\"skipped\":%lu,\"failed\":%lu,\"elapsed_ns\":%lu,"
+           "\"statements_per_sec\":%.0f,\"replayed\":{",
+           run->statements, run->skipped, run->failed, run->elapsed_ns, per_sec);
+    for (uint32_t pass = 0; pass < 2; pass++) {
+      stats_histogram_t* histograms = pass == 0 ? run->replayed : run->recorded;
+      for (uint32_t i = 0; i < TRACE_KIND_COUNT; i++) {
+        printf("%s", i ? "," : "");
+        stats_histogram_print(stdout, trace_kind_name(i), &histograms[i], db_true);
+      }
+      printf(pass == 0 ? "},\"recorded\":{" : "}}\n");
+    }
+    return;
+  }
+
+  printf("%lu statements in %.3f s (%.0f/s, %s), %lu failed, %lu skipped\n",
+         run->statements, seconds, per_sec, options->paced ? "paced" : "as fast as possible",
+         run->failed, run->skipped);
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    stats_histogram_t* histograms = pass == 0 ? run->replayed : run->recorded;
+    printf("%s:\n", pass == 0 ? "Replayed" : "Recorded");
+    for (uint32_t i = 0; i < TRACE_KIND_COUNT; i++) {
+      if (atomic_load_explicit(&(histograms[i].count), memory_order_relaxed) > 0) {
+        stats_histogram_print(stdout, trace_kind_name(i), &histograms[i], db_false);
+      }
+    }
+  }
+}
+
+static db_bool parse_flag(const char* arg, const char* name, const char** value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+    *value = arg + len + 1;
+    return db_true;
+  }
+  return db_false;
+}
+
+static void usage() {
+  printf("usage: db_replay --trace=TRACE [--db=%s] [--paced] [--speed=X] [--json]\n",
+         DEFAULT_REPLAY_DB);
+  printf("                 [engine options]\n");
+  printf("engine options:\n");
+  db_options_usage();
+}
+
+int main(int argc, char** argv) {
+  replay_options_t options;
+  options.trace_name = NULL;
+  options.db_name = DEFAULT_REPLAY_DB;
+  options.paced = db_false;
+  options.speed = 1.0;
+  options.json = db_false;
+  db_options_init(&(options.db_options));
+
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    if (parse_flag(argv[i], "--trace", &value)) {
+      options.trace_name = value;
+    } else if (parse_flag(argv[i], "--db", &value)) {
+      options.db_name = value;
+    } else if (strcmp(argv[i], "--paced") == 0) {
+      options.paced = db_true;
+    } else if (parse_flag(argv[i], "--speed", &value) && strtod(value, NULL) > 0) {
+      options.speed = strtod(value, NULL);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = db_true;
+    } else if (!db_options_parse_flag(&(options.db_options), argv[i])) {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (options.trace_name == NULL) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  trace_t* trace = trace_open(options.trace_name);
+  if (trace == NULL) {
+    fprintf(stderr, "Unable to read trace %s\n", options.trace_name);
+    return EXIT_FAILURE;
+  }
+  libdb_t* db;
+  if (libdb_open_with(options.db_name, &(options.db_options), &db) != DB_OK) {
+    fprintf(stderr, "Unable to open %s: %s\n", options.db_name, libdb_errmsg(db));
+    return EXIT_FAILURE;
+  }
+
+  /* Statements print their results; send them to /dev/null for the run */
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  replay_run_t* run = calloc(1, sizeof(replay_run_t));
+  db_bool complete = replay(&options, trace, libdb_table(db), run);
+  DbStatus close_status = libdb_close(db);
+  trace_close(trace);
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+
+  if (!complete) {
+    fprintf(stderr, "Trace %s is truncated or corrupt; replayed up to the damage\n",
+            options.trace_name);
+  }
+  report(&options, run);
+  free(run);
+
+  return complete && close_status == DB_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,94 @@
+#include "result.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Largest encoding of one row in either format */
+#define RESULT_MAX_ROW_SIZE (32 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+
+result_writer_t* new_result_writer(FILE* out, OutputFormat format) {
+  result_writer_t* writer = malloc(sizeof(result_writer_t));
+  writer->out = out;
+  writer->format = format;
+  writer->row_count = 0;
+  writer->size = 0;
+  return writer;
+}
+
+void result_flush(result_writer_t* writer) {
+  if (writer->size == 0) {
+    return;
+  }
+  if (fwrite(writer->buf, 1, writer->size, writer->out) != writer->size) {
+    db_fatal("Error writing result");
+  }
+  writer->size = 0;
+}
+
+static char* put_u64_text(char* dst, uint64_t value) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n) {
+    *dst++ = digits[--n];
+  }
+  return dst;
+}
+
+static char* put_bytes(char* dst, const void* src, size_t len) {
+  memcpy(dst, src, len);
+  return dst + len;
+}
+
+static char* put_string_binary(char* dst, const char* str, uint32_t len) {
+  uint16_t len16 = len;
+  dst = put_bytes(dst, &len16, sizeof(len16));
+  return put_bytes(dst, str, len);
+}
+
+void result_write_row(result_writer_t* writer, row_view_t* row) {
+  if (writer->size + RESULT_MAX_ROW_SIZE > RESULT_BUF_SIZE) {
+    result_flush(writer);
+  }
+
+  char* dst = writer->buf + writer->size;
+  switch (writer->format) {
+    case OUTPUT_TEXT:
+      *dst++ = '(';
+      dst = put_u64_text(dst, row->id);
+      *dst++ = ' ';
+      dst = put_bytes(dst, row->username, row->username_len);
+      *dst++ = ' ';
+      dst = put_bytes(dst, row->email, row->email_len);
+      *dst++ = ')';
+      *dst++ = '\n';
+      break;
+    case OUTPUT_BINARY:
+      *dst++ = RESULT_ROW_TAG;
+      dst = put_bytes(dst, &(row->id), sizeof(row->id));
+      dst = put_string_binary(dst, row->username, row->username_len);
+      dst = put_string_binary(dst, row->email, row->email_len);
+      break;
+  }
+
+  writer->size = dst - writer->buf;
+  writer->row_count++;
+}
+
+void result_end(result_writer_t* writer) {
+  if (writer->format == OUTPUT_BINARY) {
+    if (writer->size + RESULT_MAX_ROW_SIZE > RESULT_BUF_SIZE) {
+      result_flush(writer);
+    }
+    char* dst = writer->buf + writer->size;
+    *dst++ = RESULT_END_TAG;
+    dst = put_bytes(dst, &(writer->row_count), sizeof(writer->row_count));
+    writer->size = dst - writer->buf;
+  }
+  writer->row_count = 0;
+  result_flush(writer);
+}
@@ -0,0 +1,35 @@
+#ifndef __RESULT_H__
+#define __RESULT_H__
+#include <stdio.h>
+#include <stdint.h>
+#include "row.h"
+
+// ---------- result writer -------------
+#define RESULT_BUF_SIZE (64 * 1024)
+
+/*
+ * OUTPUT_TEXT prints "(id username email)" lines.
+ * OUTPUT_BINARY emits, in native byte order, per row:
+ *   'R' u64 id u16 username_len username u16 email_len email
+ * and once per result set:
+ *   'E' u32 row_count
+ */
+typedef enum { OUTPUT_TEXT, OUTPUT_BINARY } OutputFormat;
+
+#define RESULT_ROW_TAG 'R'
+#define RESULT_END_TAG 'E'
+
+typedef struct __result_writer {
+  FILE* out;
+  OutputFormat format;
+  uint32_t row_count;
+  size_t size;
+  char buf[RESULT_BUF_SIZE];
+} result_writer_t;
+
+result_writer_t* new_result_writer(FILE* out, OutputFormat format);
+void result_write_row(result_writer_t* writer, row_view_t* row);
+void result_end(result_writer_t* writer);
+void result_flush(result_writer_t* writer);
+
+#endif
@@ -1,5 +1,6 @@
 #include "row.h"
 #include <memory.h>
+#include <string.h>
 
 void serialize_row(row_t* src, void* dst) {
   memcpy(dst + ID_OFFSET, &(src->id), ID_SIZE);
@@ -11,4 +12,12 @@ void deserialize_row(void* src, row_t* dst) {
   memcpy(&(dst->id), src + ID_OFFSET, ID_SIZE);
   memcpy(&(dst->username), src + USERNAME_OFFSET, USERNAME_SIZE);
   memcpy(&(dst->email), src + EMAIL_OFFSET, EMAIL_SIZE);
-}
\ No newline at end of file
+}
+
+void row_view(void* src, row_view_t* dst) {
+  memcpy(&(dst->id), src + ID_OFFSET, ID_SIZE);
+  dst->username = src + USERNAME_OFFSET;
+  dst->username_len = strnlen(dst->username, USERNAME_SIZE);
+  dst->email = src + EMAIL_OFFSET;
+  dst->email_len = strnlen(dst->email, EMAIL_SIZE);
+}
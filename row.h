@@ -8,11 +8,23 @@
 #define COLUMN_EMAIL_SIZE 255
 
 typedef struct {
-  uint32_t id;
+  uint64_t id;
   char username[COLUMN_USERNAME_SIZE];
   char email[COLUMN_EMAIL_SIZE];
 } row_t;
 
+/*
+ * Zero-copy view of a serialized row. Strings point straight into
+ * the page and are not NUL terminated when they fill their column.
+ */
+typedef struct {
+  uint64_t id;
+  const char* username;
+  uint32_t username_len;
+  const char* email;
+  uint32_t email_len;
+} row_view_t;
+
 #define ID_SIZE size_of_attribute(row_t, id)
 #define USERNAME_SIZE size_of_attribute(row_t, username)
 #define EMAIL_SIZE size_of_attribute(row_t, email)
@@ -23,5 +35,6 @@ typedef struct {
 
 void serialize_row(row_t* , void*);
 void deserialize_row(void* , row_t*);
+void row_view(void* , row_view_t*);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,545 @@
+#include "shard.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SHARD_MAGIC 0x44524853 /* "SHRD" */
+#define SHARD_FORMAT_VERSION 2
+/* Ops a worker takes off its queue per lock round trip */
+#define SHARD_WORKER_BATCH 64
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_shards;
+  uint32_t mode;
+  uint64_t splits[SHARD_MAX - 1];
+} shard_manifest_t;
+
+/* Version 1, from before ids were 64 bit */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_shards;
+  uint32_t mode;
+  uint32_t splits[SHARD_MAX - 1];
+} shard_manifest_v1_t;
+
+typedef enum { SHARD_OP_INSERT, SHARD_OP_GET } ShardOpKind;
+
+typedef struct {
+  DbStatus status;
+  db_bool done;
+} shard_reply_t;
+
+typedef struct {
+  ShardOpKind kind;
+  uint64_t id;
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+  /* Lookups only: where the row goes, and the caller waiting on it */
+  row_t* row;
+  shard_reply_t* reply;
+} shard_op_t;
+
+typedef struct {
+  libdb_t* handle;
+  pthread_t thread;
+  db_bool started;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  /* Broadcast after every batch: replies are ready, the queue may be idle */
+  pthread_cond_t progress;
+  shard_op_t ops[SHARD_QUEUE_SIZE];
+  uint32_t head;
+  uint32_t count;
+  /* Taken off the queue but not finished */
+  uint32_t in_flight;
+  db_bool stopping;
+  /* First failed insert since the last shard_wait() */
+  DbStatus error;
+} shard_t;
+
+struct __shard_db {
+  uint32_t num_shards;
+  ShardMode mode;
+  uint64_t splits[SHARD_MAX - 1];
+  shard_t* shards;
+  char errmsg[DB_ERROR_MESSAGE_SIZE];
+};
+
+static DbStatus shard_fail(shard_db_t* db, DbStatus status, const char* message) {
+  strncpy(db->errmsg, message, DB_ERROR_MESSAGE_SIZE - 1);
+  db->errmsg[DB_ERROR_MESSAGE_SIZE - 1] = '\0';
+  return status;
+}
+
+static db_bool valid_layout(uint32_t num_shards, uint32_t mode, const uint64_t* splits) {
+  if (num_shards < 1 || num_shards > SHARD_MAX || mode > SHARD_BY_RANGE) {
+    return db_false;
+  }
+  for (uint32_t i = 1; mode == SHARD_BY_RANGE && i + 1 < num_shards; i++) {
+    if (splits[i] <= splits[i - 1]) {
+      return db_false;
+    }
+  }
+  return db_true;
+}
+
+/*
+An existing manifest decides the layout; otherwise the options do and
+are recorded. The manifest is written once, before any shard file.
+*/
+static DbStatus manifest_open(shard_db_t* db, const char* base, const shard_options_t* options) {
+  size_t name_len = strlen(base) + strlen(SHARD_FILE_SUFFIX) + 1;
+  char* filename = malloc(name_len);
+  snprintf(filename, name_len, "%s%s", base, SHARD_FILE_SUFFIX);
+
+  shard_manifest_t manifest;
+  memset(&manifest, 0, sizeof(manifest));
+  int fd = open(filename, O_RDONLY);
+  if (fd != -1) {
+    ssize_t bytes_read = pread(fd, &manifest, sizeof(manifest), 0);
+    close(fd);
+    free(filename);
+    if (bytes_read == sizeof(shard_manifest_v1_t) && manifest.version == 1) {
+      shard_manifest_v1_t v1;
+      memcpy(&v1, &manifest, sizeof(v1));
+      for (uint32_t i = 0; i < SHARD_MAX - 1; i++) {
+        manifest.splits[i] = v1.splits[i];
+      }
+      manifest.version = SHARD_FORMAT_VERSION;
+      bytes_read = sizeof(manifest);
+    }
+    if (bytes_read != sizeof(manifest) || manifest.magic != SHARD_MAGIC ||
+        manifest.version != SHARD_FORMAT_VERSION ||
+        !valid_layout(manifest.num_shards, manifest.mode, manifest.splits)) {
+      return shard_fail(db, DB_IO_ERROR, "Unsupported or corrupt shard manifest.");
+    }
+  } else {
+    manifest.magic = SHARD_MAGIC;
+    manifest.version = SHARD_FORMAT_VERSION;
+    manifest.num_shards = options->num_shards;
+    manifest.mode = options->mode;
+    for (uint32_t i = 0; i + 1 < options->num_shards && i + 1 < SHARD_MAX; i++) {
+      manifest.splits[i] = options->splits != NULL
+                               ? options->splits[i]
+                               : UINT64_MAX / options->num_shards * (i + 1);
+    }
+    if (!valid_layout(manifest.num_shards, manifest.mode, manifest.splits)) {
+      free(filename);
+      return shard_fail(db, DB_INVALID_ARGUMENT, "Invalid shard count, mode or splits.");
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR);
+    free(filename);
+    if (fd == -1) {
+      return shard_fail(db, DB_IO_ERROR, "Unable to create shard manifest.");
+    }
+    db_bool ok = write(fd, &manifest, sizeof(manifest)) == sizeof(manifest) && fsync(fd) == 0;
+    close(fd);
+    if (!ok) {
+      return shard_fail(db, DB_IO_ERROR, "Error writing shard manifest.");
+    }
+  }
+
+  db->num_shards = manifest.num_shards;
+  db->mode = manifest.mode;
+  memcpy(db->splits, manifest.splits, sizeof(db->splits));
+  return DB_OK;
+}
+
+static void shard_run(shard_t* shard, shard_op_t* op) {
+  DbStatus status;
+  switch (op->kind) {
+    case SHARD_OP_INSERT:
+      status = libdb_insert(shard->handle, op->id, op->username, op->email);
+      if (status != DB_OK) {
+        pthread_mutex_lock(&(shard->lock));
+        if (shard->error == DB_OK) {
+          shard->error = status;
+        }
+        pthread_mutex_unlock(&(shard->lock));
+      }
+      break;
+    case SHARD_OP_GET:
+      op->reply->status = libdb_get(shard->handle, op->id, op->row);
+      break;
+  }
+}
+
+/*
+The worker drains its queue before honouring a stop, so closing never
+drops queued inserts.
+*/
+static void* shard_main(void* arg) {
+  shard_t* shard = arg;
+  shard_op_t batch[SHARD_WORKER_BATCH];
+
+  pthread_mutex_lock(&(shard->lock));
+  while (1) {
+    while (shard->count == 0 && !shard->stopping) {
+      pthread_cond_wait(&(shard->not_empty), &(shard->lock));
+    }
+    if (shard->count == 0) {
+      break;
+    }
+
+    uint32_t n = shard->count < SHARD_WORKER_BATCH ? shard->count : SHARD_WORKER_BATCH;
+    for (uint32_t i = 0; i < n; i++) {
+      batch[i] = shard->ops[(shard->head + i) % SHARD_QUEUE_SIZE];
+    }
+    shard->head = (shard->head + n) % SHARD_QUEUE_SIZE;
+    shard->count -= n;
+    shard->in_flight = n;
+    pthread_cond_broadcast(&(shard->not_full));
+    pthread_mutex_unlock(&(shard->lock));
+
+    for (uint32_t i = 0; i < n; i++) {
+      shard_run(shard, &batch[i]);
+    }
+
+    pthread_mutex_lock(&(shard->lock));
+    for (uint32_t i = 0; i < n; i++) {
+      if (batch[i].kind == SHARD_OP_GET) {
+        batch[i].reply->done = db_true;
+      }
+    }
+    shard->in_flight = 0;
+    pthread_cond_broadcast(&(shard->progress));
+  }
+  pthread_mutex_unlock(&(shard->lock));
+
+  return NULL;
+}
+
+static void shard_enqueue(shard_t* shard, const shard_op_t* op) {
+  pthread_mutex_lock(&(shard->lock));
+  while (shard->count == SHARD_QUEUE_SIZE) {
+    pthread_cond_wait(&(shard->not_full), &(shard->lock));
+  }
+  shard->ops[(shard->head + shard->count) % SHARD_QUEUE_SIZE] = *op;
+  shard->count++;
+  pthread_cond_signal(&(shard->not_empty));
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+/* Wait for every queue to empty without consuming the insert errors */
+static void shard_drain(shard_db_t* db) {
+  for (uint32_t i = 0; i < db->num_shards; i++) {
+    shard_t* shard = &(db->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    while (shard->count > 0 || shard->in_flight > 0) {
+      pthread_cond_wait(&(shard->progress), &(shard->lock));
+    }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
+
+void shard_options_init(shard_options_t* options) {
+  options->num_shards = 4;
+  options->mode = SHARD_BY_HASH;
+  options->splits = NULL;
+  db_options_init(&(options->db_options));
+}
+
+DbStatus shard_open(const char* base, const shard_options_t* options, shard_db_t** out) {
+  if (base == NULL || options == NULL || out == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  shard_db_t* db = calloc(1, sizeof(shard_db_t));
+  *out = db;
+
+  DbStatus status = manifest_open(db, base, options);
+  if (status != DB_OK) {
+    return status;
+  }
+
+  db->shards = calloc(db->num_shards, sizeof(shard_t));
+  for (uint32_t i = 0; i < db->num_shards; i++) {
+    shard_t* shard = &(db->shards[i]);
+    pthread_mutex_init(&(shard->lock), NULL);
+    pthread_cond_init(&(shard->not_empty), NULL);
+    pthread_cond_init(&(shard->not_full), NULL);
+    pthread_cond_init(&(shard->progress), NULL);
+    shard->error = DB_OK;
+  }
+
+  size_t name_len = strlen(base) + 12;
+  char* filename = malloc(name_len);
+  for (uint32_t i = 0; i < db->num_shards; i++) {
+    snprintf(filename, name_len, "%s.%u", base, i);
+    status = libdb_open_with(filename, &(options->db_options), &(db->shards[i].handle));
+    if (status != DB_OK) {
+      free(filename);
+      return shard_fail(db, status, libdb_errmsg(db->shards[i].handle));
+    }
+  }
+  free(filename);
+
+  for (uint32_t i = 0; i < db->num_shards; i++) {
+    shard_t* shard = &(db->shards[i]);
+    if (pthread_create(&(shard->thread), NULL, shard_main, shard) != 0) {
+      return shard_fail(db, DB_IO_ERROR, "Unable to start shard worker.");
+    }
+    shard->started = db_true;
+  }
+
+  return DB_OK;
+}
+
+DbStatus shard_close(shard_db_t* db) {
+  if (db == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  DbStatus status = DB_OK;
+  for (uint32_t i = 0; db->shards != NULL && i < db->num_shards; i++) {
+    shard_t* shard = &(db->shards[i]);
+    if (shard->started) {
+      pthread_mutex_lock(&(shard->lock));
+      shard->stopping = db_true;
+      pthread_cond_signal(&(shard->not_empty));
+      pthread_mutex_unlock(&(shard->lock));
+      pthread_join(shard->thread, NULL);
+    }
+    if (status == DB_OK) {
+      status = shard->error;
+    }
+
+    if (shard->handle != NULL) {
+      DbStatus close_status = libdb_close(shard->handle);
+      if (status == DB_OK) {
+        status = close_status;
+      }
+    }
+    pthread_cond_destroy(&(shard->progress));
+    pthread_cond_destroy(&(shard->not_full));
+    pthread_cond_destroy(&(shard->not_empty));
+    pthread_mutex_destroy(&(shard->lock));
+  }
+
+  free(db->shards);
+  free(db);
+  return status;
+}
+
+/* Same checks as libdb_insert(), made before queueing so they are reported here */
+DbStatus shard_insert(shard_db_t* db, uint64_t id, const char* username, const char* email) {
+  if (db == NULL || username == NULL || email == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  size_t username_len = strlen(username);
+  size_t email_len = strlen(email);
+  if (username_len > COLUMN_USERNAME_SIZE || email_len > COLUMN_EMAIL_SIZE) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  shard_op_t op;
+  op.kind = SHARD_OP_INSERT;
+  op.id = id;
+  memcpy(op.username, username, username_len + 1);
+  memcpy(op.email, email, email_len + 1);
+  op.row = NULL;
+  op.reply = NULL;
+  shard_enqueue(&(db->shards[shard_of(db, id)]), &op);
+
+  return DB_OK;
+}
+
+DbStatus shard_wait(shard_db_t* db) {
+  if (db == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  shard_drain(db);
+  DbStatus status = DB_OK;
+  for (uint32_t i = 0; i < db->num_shards; i++) {
+    shard_t* shard = &(db->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    if (status == DB_OK) {
+      status = shard->error;
+    }
+    shard->error = DB_OK;
+    pthread_mutex_unlock(&(shard->lock));
+  }
+  return status;
+}
+
+/* Queued behind earlier inserts to the same shard, so it sees them */
+DbStatus shard_get(shard_db_t* db, uint64_t id, row_t* row) {
+  if (db == NULL || row == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  shard_reply_t reply;
+  reply.status = DB_IO_ERROR;
+  reply.done = db_false;
+
+  shard_op_t op;
+  op.kind = SHARD_OP_GET;
+  op.id = id;
+  op.row = row;
+  op.reply = &reply;
+
+  shard_t* shard = &(db->shards[shard_of(db, id)]);
+  shard_enqueue(shard, &op);
+  pthread_mutex_lock(&(shard->lock));
+  while (!reply.done) {
+    pthread_cond_wait(&(shard->progress), &(shard->lock));
+  }
+  pthread_mutex_unlock(&(shard->lock));
+
+  return reply.status;
+}
+
+static DbStatus iter_load(shard_iter_t* iter, uint32_t shard) {
+  if (!libdb_iter_valid(iter->iters[shard])) {
+    return DB_OK;
+  }
+  row_view_t row;
+  DbStatus status = libdb_iter_row(iter->iters[shard], &row);
+  iter->ids[shard] = row.id;
+  return status;
+}
+
+/* A linear pick is cheaper than a heap for the few shards a node has */
+static void iter_pick(shard_iter_t* iter) {
+  iter->current = iter->num_shards;
+  for (uint32_t i = 0; i < iter->num_shards; i++) {
+    if (libdb_iter_valid(iter->iters[i]) &&
+        (iter->current == iter->num_shards || iter->ids[i] < iter->ids[iter->current])) {
+      iter->current = i;
+    }
+  }
+}
+
+DbStatus shard_iter_open(shard_db_t* db, shard_iter_t* iter) {
+  if (db == NULL || iter == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  iter->db = db;
+  iter->num_shards = db->num_shards;
+  iter->current = db->num_shards;
+
+  for (uint32_t i = 0; i < db->num_shards; i++) {
+    DbStatus status = libdb_iter_open(db->shards[i].handle, &(iter->iters[i]));
+    if (status != DB_OK) {
+      iter->num_shards = i;
+      shard_iter_close(iter);
+      return status;
+    }
+  }
+
+  return DB_OK;
+}
+
+DbStatus shard_iter_seek(shard_iter_t* iter, uint64_t start_id) {
+  if (iter == NULL || iter->db == NULL) {
+    return DB_INVALID_ARGUMENT;
+  }
+  iter->current = iter->num_shards;
+
+  shard_drain(iter->db);
+  for (uint32_t i = 0; i < iter->num_shards; i++) {
+    DbStatus status = libdb_iter_seek(iter->iters[i], start_id);
+    if (status == DB_OK) {
+      status = iter_load(iter, i);
+    }
+    if (status != DB_OK) {
+      return status;
+    }
+  }
+  iter_pick(iter);
+
+  return DB_OK;
+}
+
+db_bool shard_iter_valid(shard_iter_t* iter) {
+  return iter != NULL && iter->db != NULL && iter->current < iter->num_shards;
+}
+
+DbStatus shard_iter_row(shard_iter_t* iter, row_view_t* row) {
+  if (row == NULL || !shard_iter_valid(iter)) {
+    return DB_INVALID_ARGUMENT;
+  }
+  return libdb_iter_row(iter->iters[iter->current], row);
+}
+
+DbStatus shard_iter_next(shard_iter_t* iter) {
+  if (!shard_iter_valid(iter)) {
+    return DB_INVALID_ARGUMENT;
+  }
+
+  uint32_t current = iter->current;
+  DbStatus status = libdb_iter_next(iter->iters[current]);
+  if (status == DB_OK) {
+    status = iter_load(iter, current);
+  }
+  if (status != DB_OK) {
+    iter->current = iter->num_shards;
+    return status;
+  }
+  iter_pick(iter);
+
+  return DB_OK;
+}
+
+void shard_iter_close(shard_iter_t* iter) {
+  for (uint32_t i = 0; i < iter->num_shards; i++) {
+    libdb_iter_close(iter->iters[i]);
+  }
+  iter->db = NULL;
+  iter->num_shards = 0;
+}
+
+uint32_t shard_count(shard_db_t* db) {
+  return db->num_shards;
+}
+
+/*
+Fibonacci hashing of the id folded to 32 bits, which places ids below
+2^32 where they always were, then a multiply-shift into [0, num_shards)
+*/
+uint32_t shard_of(shard_db_t* db, uint64_t id) {
+  if (db->mode == SHARD_BY_HASH) {
+    uint32_t folded = (uint32_t)id ^ (uint32_t)(id >> 32);
+    return ((uint64_t)(folded * 2654435769U) * db->num_shards) >> 32;
+  }
+
+  uint32_t low = 0;
+  uint32_t high = db->num_shards - 1;
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (id < db->splits[mid]) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+const char* shard_errmsg(shard_db_t* db) {
+  if (db == NULL) {
+    return "invalid handle";
+  }
+  for (uint32_t i = 0; db->errmsg[0] == '\0' && db->shards != NULL && i < db->num_shards; i++) {
+    if (db->shards[i].handle != NULL && libdb_errmsg(db->shards[i].handle)[0] != '\0') {
+      return libdb_errmsg(db->shards[i].handle);
+    }
+  }
+  return db->errmsg;
+}
+
+libdb_t* shard_handle(shard_db_t* db, uint32_t shard) {
+  return db->shards[shard].handle;
+}
@@ -0,0 +1,88 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+#include <stdint.h>
+#include "def.h"
+#include "libdb.h"
+
+// ---------- sharded table -------------
+/*
+ * One logical table spread over num_shards libdb handles on files
+ * <base>.0, <base>.1, ... Each shard has a worker thread that owns
+ * its handle; callers, from any number of threads, only queue work
+ * for it. Inserts are queued and return at once, so a single caller
+ * keeps every shard busy; their outcome is collected by shard_wait().
+ * Point lookups are routed to the owning worker and waited on.
+ *
+ * The layout is recorded in <base>.shards when the table is created
+ * and wins over the options afterwards, like the page size does.
+ */
+#define SHARD_MAX 64
+#define SHARD_QUEUE_SIZE 1024
+#define SHARD_FILE_SUFFIX ".shards"
+
+typedef enum {
+  /* Spread ids evenly whatever their distribution */
+  SHARD_BY_HASH,
+  /* Keep id ranges together; see splits */
+  SHARD_BY_RANGE
+} ShardMode;
+
+typedef struct {
+  uint32_t num_shards;
+  ShardMode mode;
+  /*
+   * SHARD_BY_RANGE only: shard i holds ids below splits[i] and at or
+   * above splits[i - 1]; num_shards - 1 ascending ids. NULL splits the
+   * id space evenly.
+   */
+  const uint64_t* splits;
+  db_options_t db_options;
+} shard_options_t;
+
+typedef struct __shard_db shard_db_t;
+
+/*
+ * Rows from every shard merged into id order. Like libdb iterators it
+ * reads the shard handles directly; seeking first waits for queued
+ * inserts, and inserting invalidates it. The caller owns the storage;
+ * shard_iter_close() releases the libdb iterators it holds.
+ */
+typedef struct {
+  shard_db_t* db;
+  uint32_t num_shards;
+  /* Shard holding the next row, or num_shards at the end */
+  uint32_t current;
+  uint64_t ids[SHARD_MAX];
+  libdb_iter_t* iters[SHARD_MAX];
+} shard_iter_t;
+
+void shard_options_init(shard_options_t* options);
+/* As with libdb_open(), a handle to close is returned even on failure */
+DbStatus shard_open(const char* base, const shard_options_t* options, shard_db_t** db);
+/* Waits for queued work; returns the first error shard_wait() would have */
+DbStatus shard_close(shard_db_t* db);
+
+DbStatus shard_insert(shard_db_t* db, uint64_t id, const char* username, const char* email);
+/*
+ * Wait until every queued insert is done. Returns DB_OK, or the first
+ * failure since the last wait (e.g. DB_DUPLICATE_KEY); the other
+ * inserts were still applied.
+ */
+DbStatus shard_wait(shard_db_t* db);
+DbStatus shard_get(shard_db_t* db, uint64_t id, row_t* row);
+
+DbStatus shard_iter_open(shard_db_t* db, shard_iter_t* iter);
+DbStatus shard_iter_seek(shard_iter_t* iter, uint64_t start_id);
+db_bool shard_iter_valid(shard_iter_t* iter);
+DbStatus shard_iter_row(shard_iter_t* iter, row_view_t* row);
+DbStatus shard_iter_next(shard_iter_t* iter);
+void shard_iter_close(shard_iter_t* iter);
+
+uint32_t shard_count(shard_db_t* db);
+/* Shard that owns id */
+uint32_t shard_of(shard_db_t* db, uint64_t id);
+const char* shard_errmsg(shard_db_t* db);
+/* Escape hatch for tools, as libdb_table(); only safe after shard_wait() */
+libdb_t* shard_handle(shard_db_t* db, uint32_t shard);
+
+#endif
@@ -0,0 +1,162 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+_Thread_local stats_block_t* stats_local_block = NULL;
+
+static stats_block_t* stats_blocks = NULL;
+static pthread_mutex_t stats_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* stats_counter_names[STATS_COUNTER_COUNT] = {
+  "cache_hits",
+  "cache_misses",
+  "disk_reads",
+  "disk_writes",
+  "bytes_read",
+  "bytes_written",
+  "leaf_splits",
+  "internal_splits",
+  "rows_scanned",
+  "rows_returned",
+  "checkpoints",
+  "buffer_drains",
+  "bloom_negatives",
+  "pages_prefetched",
+};
+
+/*
+Blocks are never freed: a thread that exits leaves its counts behind
+so the totals stay monotonic.
+*/
+stats_block_t* stats_register_thread() {
+  stats_block_t* block = calloc(1, sizeof(stats_block_t));
+
+  pthread_mutex_lock(&stats_blocks_lock);
+  block->next = stats_blocks;
+  stats_blocks = block;
+  pthread_mutex_unlock(&stats_blocks_lock);
+
+  stats_local_block = block;
+  return block;
+}
+
+void stats_snapshot(stats_snapshot_t* snapshot) {
+  memset(snapshot, 0, sizeof(stats_snapshot_t));
+
+  pthread_mutex_lock(&stats_blocks_lock);
+  for (stats_block_t* block = stats_blocks; block != NULL; block = block->next) {
+    for (uint32_t i = 0; i < STATS_COUNTER_COUNT; i++) {
+      snapshot->values[i] += atomic_load_explicit(&(block->values[i]), memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&stats_blocks_lock);
+}
+
+/* Counts racing with a reset may survive it */
+void stats_reset() {
+  pthread_mutex_lock(&stats_blocks_lock);
+  for (stats_block_t* block = stats_blocks; block != NULL; block = block->next) {
+    for (uint32_t i = 0; i < STATS_COUNTER_COUNT; i++) {
+      atomic_store_explicit(&(block->values[i]), 0, memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&stats_blocks_lock);
+}
+
+const char* stats_counter_name(StatsCounter counter) {
+  return stats_counter_names[counter];
+}
+
+static uint32_t bucket_index(uint64_t value) {
+  if (value < 16) {
+    return value;
+  }
+  uint32_t exponent = 63 - __builtin_clzll(value);
+  uint32_t sub_bucket = (value >> (exponent - 3)) & 7;
+  return 16 + (exponent - 4) * 8 + sub_bucket;
+}
+
+static uint64_t bucket_upper_bound(uint32_t index) {
+  if (index < 16) {
+    return index;
+  }
+  uint32_t exponent = (index - 16) / 8 + 4;
+  uint64_t width = 1ULL << (exponent - 3);
+  uint64_t lower = (1ULL << exponent) + ((index - 16) % 8) * width;
+  return lower + (width - 1);
+}
+
+void stats_histogram_record(stats_histogram_t* histogram, uint64_t value) {
+  atomic_fetch_add_explicit(&(histogram->count), 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&(histogram->total), value, memory_order_relaxed);
+  atomic_fetch_add_explicit(&(histogram->buckets[bucket_index(value)]), 1,
+                            memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&(histogram->max), memory_order_relaxed);
+  while (value > max &&
+         !atomic_compare_exchange_weak_explicit(&(histogram->max), &max, value,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+uint64_t stats_histogram_percentile(stats_histogram_t* histogram, double p) {
+  uint64_t count = atomic_load_explicit(&(histogram->count), memory_order_relaxed);
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(p * count);
+  if (rank >= count) {
+    rank = count - 1;
+  }
+
+  uint64_t seen = 0;
+  uint64_t max = atomic_load_explicit(&(histogram->max), memory_order_relaxed);
+  for (uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    seen += atomic_load_explicit(&(histogram->buckets[i]), memory_order_relaxed);
+    if (seen > rank) {
+      uint64_t upper = bucket_upper_bound(i);
+      return upper < max ? upper : max;
+    }
+  }
+  return max;
+}
+
+void stats_histogram_reset(stats_histogram_t* histogram) {
+  atomic_store_explicit(&(histogram->count), 0, memory_order_relaxed);
+  atomic_store_explicit(&(histogram->total), 0, memory_order_relaxed);
+  atomic_store_explicit(&(histogram->max), 0, memory_order_relaxed);
+  for (uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    atomic_store_explicit(&(histogram->buckets[i]), 0, memory_order_relaxed);
+  }
+}
+
+void stats_histogram_print(FILE* out, const char* name, stats_histogram_t* histogram,
+                           db_bool json) {
+  uint64_t count = atomic_load_explicit(&(histogram->count), memory_order_relaxed);
+  uint64_t total = atomic_load_explicit(&(histogram->total), memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&(histogram->max), memory_order_relaxed);
+  uint64_t p50 = stats_histogram_percentile(histogram, 0.50);
+  uint64_t p99 = stats_histogram_percentile(histogram, 0.99);
+  uint64_t p999 = stats_histogram_percentile(histogram, 0.999);
+
+  if (json) {
+    fprintf(out,
+            "\"%s\":{\"count\":%lu,\"total_ns\":%lu,\"p50_ns\":%lu,"
+            "\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}",
+            name, count, total, p50, p99, p999, max);
+  } else {
+    fprintf(out, "%-10s count %lu avg %.2f us p50 %.2f us p99 %.2f us p999 %.2f us max %.2f us\n",
+            name, count, count ? total / 1e3 / count : 0.0, p50 / 1e3, p99 / 1e3,
+            p999 / 1e3, max / 1e3);
+  }
+}
+
+uint64_t stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,83 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "def.h"
+
+// ---------- stats -------------
+/*
+ * Engine counters are kept per thread and only summed when read, so
+ * bumping one on the hot path is a plain load/add/store on memory the
+ * thread owns. The relaxed atomics just make the cross-thread read
+ * well defined.
+ */
+typedef enum {
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+  STATS_DISK_READS,
+  STATS_DISK_WRITES,
+  STATS_BYTES_READ,
+  STATS_BYTES_WRITTEN,
+  STATS_LEAF_SPLITS,
+  STATS_INTERNAL_SPLITS,
+  STATS_ROWS_SCANNED,
+  STATS_ROWS_RETURNED,
+  STATS_CHECKPOINTS,
+  STATS_BUFFER_DRAINS,
+  STATS_BLOOM_NEGATIVES,
+  STATS_PAGES_PREFETCHED,
+  STATS_COUNTER_COUNT
+} StatsCounter;
+
+typedef struct __stats_block {
+  _Atomic uint64_t values[STATS_COUNTER_COUNT];
+  struct __stats_block* next;
+} stats_block_t;
+
+typedef struct {
+  uint64_t values[STATS_COUNTER_COUNT];
+} stats_snapshot_t;
+
+extern _Thread_local stats_block_t* stats_local_block;
+stats_block_t* stats_register_thread();
+
+static inline void stats_add(StatsCounter counter, uint64_t n) {
+  stats_block_t* block = stats_local_block;
+  if (block == NULL) {
+    block = stats_register_thread();
+  }
+  _Atomic uint64_t* value = &(block->values[counter]);
+  atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+#define STATS_ADD(counter, n) stats_add(counter, n)
+#define STATS_INC(counter) stats_add(counter, 1)
+
+void stats_snapshot(stats_snapshot_t* snapshot);
+void stats_reset();
+const char* stats_counter_name(StatsCounter counter);
+
+/*
+ * Log-linear latency histogram in nanoseconds: exact below 16ns,
+ * then 8 sub-buckets per power of two (~12% resolution).
+ */
+#define STATS_HISTOGRAM_BUCKETS 496
+
+typedef struct {
+  _Atomic uint64_t count;
+  _Atomic uint64_t total;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_histogram_t;
+
+void stats_histogram_record(stats_histogram_t* histogram, uint64_t value);
+uint64_t stats_histogram_percentile(stats_histogram_t* histogram, double p);
+void stats_histogram_reset(stats_histogram_t* histogram);
+void stats_histogram_print(FILE* out, const char* name, stats_histogram_t* histogram,
+                           db_bool json);
+
+uint64_t stats_now_ns();
+
+#endif
@@ -1,52 +1,54 @@
 #include "table.h"
 #include "db.h"
 #include "tree.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 
-cursor_t* table_start(table_t* table) {
-  cursor_t* cursor = table_find(table, 0);
+void table_lock(table_t* table) {
+  pthread_mutex_lock(&(table->lock));
+}
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+void table_unlock(table_t* table) {
+  pthread_mutex_unlock(&(table->lock));
+}
 
-  return cursor;
+void table_start(table_t* table, cursor_t* cursor) {
+  table_seek(table, 0, cursor);
 }
 
-cursor_t* table_end(table_t* table) {
-  cursor_t* cursor = malloc(sizeof(cursor_t));
+void table_end(table_t* table, cursor_t* cursor) {
   cursor->table = table;
   cursor->page_num = table->root_page_num;
   cursor->end_of_table = db_true;
+  cursor->tree_end = db_true;
+  cursor->buffered = NULL;
 
   void* root_node = get_page(table->pager, table->root_page_num);
   uint32_t num_cells = *leaf_node_num_cells(root_node);
   cursor->cell_num = num_cells;
-
-  return cursor;
 }
 
-cursor_t* table_find(table_t* table, uint32_t key) {
+void table_find(table_t* table, uint64_t key, cursor_t* cursor) {
   uint32_t root_page_num = table->root_page_num;
   void* root_node = get_page(table->pager, root_page_num);
 
+  cursor->end_of_table = db_false;
+  cursor->tree_end = db_false;
+  cursor->buffered = NULL;
+
   switch(get_node_kind(root_node)) {
     case NODE_LEAF:
-      return leaf_node_find(table, root_page_num, key);
+      leaf_node_find(table, root_page_num, key, cursor);
+      break;
     case NODE_INTERNAL:
-      return internal_node_find(table, root_page_num, key);
+      internal_node_find(table, root_page_num, key, cursor);
+      break;
   }
 }
 
-void* cursor_value(cursor_t* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
-}
-
-void  cursor_advance(cursor_t* cursor) {
+static void tree_advance(cursor_t* cursor) {
   uint32_t page_num = cursor->page_num;
   void* node = get_page(cursor->table->pager, page_num);
 
@@ -55,10 +57,161 @@ void  cursor_advance(cursor_t* cursor) {
     /* Advance to next leaf node */
     uint32_t next_page_num = *leaf_node_next_leaf(node);
     if (next_page_num == 0) {
-      cursor->end_of_table = db_true;
+      cursor->tree_end = db_true;
     } else {
       cursor->page_num = next_page_num;
       cursor->cell_num = 0;
     }
   }
-}
\ No newline at end of file
+}
+
+/* Whether the merged position is the buffered row rather than the tree's */
+static db_bool on_buffered(cursor_t* cursor) {
+  if (cursor->buffered == NULL) {
+    return db_false;
+  }
+  if (cursor->tree_end) {
+    return db_true;
+  }
+  void* node = get_page(cursor->table->pager, cursor->page_num);
+  return cursor->buffered->key < *leaf_node_key(node, cursor->cell_num);
+}
+
+/*
+Cursor at the first key >= key. table_find() may leave it one past
+the last cell of a leaf; step onto the next leaf in that case.
+*/
+void table_seek(table_t* table, uint64_t key, cursor_t* cursor) {
+  table_find(table, key, cursor);
+
+  void* node = get_page(table->pager, cursor->page_num);
+  if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+    tree_advance(cursor);
+  }
+
+  if (table->memtable != NULL) {
+    cursor->buffered = memtable_seek(table->memtable, key);
+  }
+  cursor->end_of_table = cursor->tree_end && cursor->buffered == NULL;
+}
+
+/* Serialized row stored under key, or NULL */
+void* table_lookup(table_t* table, uint64_t key) {
+  if (table->bloom != NULL && !bloom_may_contain(table->bloom, key)) {
+    STATS_INC(STATS_BLOOM_NEGATIVES);
+    return NULL;
+  }
+
+  if (table->memtable != NULL) {
+    void* value = memtable_get(table->memtable, key);
+    if (value != NULL) {
+      return value;
+    }
+  }
+
+  cursor_t cursor;
+  if (table->hash_index != NULL) {
+    uint32_t page_num = hash_index_get(table->hash_index, key);
+    if (page_num == HASH_INDEX_NOT_FOUND) {
+      return NULL;
+    }
+    leaf_node_find(table, page_num, key, &cursor);
+  } else {
+    table_find(table, key, &cursor);
+  }
+  void* node = get_page(table->pager, cursor.page_num);
+
+  if (cursor.cell_num < *leaf_node_num_cells(node) &&
+      *leaf_node_key(node, cursor.cell_num) == key) {
+    return leaf_node_value(node, cursor.cell_num);
+  }
+  return NULL;
+}
+
+void table_rebuild_hash_index(table_t* table) {
+  hash_index_reset(table->hash_index);
+
+  cursor_t cursor;
+  table_find(table, 0, &cursor);
+  for (uint32_t page_num = cursor.page_num; ;) {
+    void* node = get_page(table->pager, page_num);
+    for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+      hash_index_put(table->hash_index, *leaf_node_key(node, i), page_num);
+    }
+    page_num = *leaf_node_next_leaf(node);
+    if (page_num == 0) {
+      break;
+    }
+  }
+}
+
+/*
+Buffered rows are taken in key order. Each lookup lands on a leaf,
+and the following rows that belong in it (keys up to its current max,
+or any key on the rightmost leaf) are merged in with one pass while
+they fit. A row for a full leaf goes through the splitting insert.
+*/
+void table_drain(table_t* table) {
+  memtable_t* memtable = table->memtable;
+  if (memtable == NULL || memtable->count == 0) {
+    return;
+  }
+  STATS_INC(STATS_BUFFER_DRAINS);
+
+  uint32_t max_cells = LEAF_NODE_MAX_CELLS(table->pager->page_size);
+  void* cells[LEAF_NODE_MAX_CELLS_LIMIT];
+  memtable_entry_t* entry = memtable_seek(memtable, 0);
+  while (entry != NULL) {
+    cursor_t cursor;
+    table_find(table, entry->key, &cursor);
+    void* node = get_page(table->pager, cursor.page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    if (num_cells >= max_cells) {
+      row_t row;
+      deserialize_row(entry->value, &row);
+      leaf_node_insert(&cursor, entry->key, &row);
+      entry = memtable_next(entry);
+      continue;
+    }
+
+    db_bool rightmost = *leaf_node_next_leaf(node) == 0;
+    uint64_t max_key = num_cells > 0 ? *leaf_node_key(node, num_cells - 1) : 0;
+    uint32_t count = 0;
+    do {
+      cells[count++] = &(entry->key);
+      entry = memtable_next(entry);
+    } while (entry != NULL && num_cells + count < max_cells &&
+             (rightmost || entry->key <= max_key));
+
+    leaf_node_insert_cells(table, cursor.page_num, cells, count);
+  }
+
+  memtable_clear(memtable);
+}
+
+uint64_t cursor_key(cursor_t* cursor) {
+  if (on_buffered(cursor)) {
+    return cursor->buffered->key;
+  }
+  void* page = get_page(cursor->table->pager, cursor->page_num);
+  return *leaf_node_key(page, cursor->cell_num);
+}
+
+void* cursor_value(cursor_t* cursor) {
+  if (on_buffered(cursor)) {
+    return cursor->buffered->value;
+  }
+  uint32_t page_num = cursor->page_num;
+  void* page = get_page(cursor->table->pager, page_num);
+  return leaf_node_value(page, cursor->cell_num);
+}
+
+void  cursor_advance(cursor_t* cursor) {
+  if (on_buffered(cursor)) {
+    cursor->buffered = memtable_next(cursor->buffered);
+  } else {
+    tree_advance(cursor);
+  }
+  cursor->end_of_table = cursor->tree_end && cursor->buffered == NULL;
+}
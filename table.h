@@ -1,24 +1,68 @@
 #ifndef __TABLE_H__
 #define __TABLE_H__
 
+#include <pthread.h>
 #include "page.h"
+#include "memtable.h"
+#include "bloom.h"
+#include "hash_index.h"
 #include "def.h"
 
+struct __checkpoint;
+struct __warm;
+struct __backup;
+
 typedef struct {
   page_t* pager;
   uint32_t root_page_num;
+  /*
+   * Held by the foreground around every statement or API call that
+   * touches pages, and by the checkpointer while it copies dirty pages.
+   */
+  pthread_mutex_t lock;
+  struct __checkpoint* checkpoint;
+  /* Optional write buffer; its keys are never also in the tree */
+  memtable_t* memtable;
+  /* The header's generation for this session; sidecars are saved with it */
+  uint64_t generation;
+  /* Optional filter over every key in the tree and the write buffer */
+  bloom_t* bloom;
+  /* Optional id -> leaf page index; when present it is authoritative */
+  hash_index_t* hash_index;
+  /* Background prefetch of the pages resident at the last close */
+  struct __warm* warm;
+  /* The last backup started, until the next one or close */
+  struct __backup* backup;
 } table_t;
 
+/*
+ * page_num/cell_num track the tree. Cursors from table_start() and
+ * table_seek() also walk the write buffer and yield the merge of both;
+ * table_find() positions on the tree alone.
+ */
 typedef struct {
   table_t* table;
   uint32_t page_num;
   uint32_t cell_num;
   db_bool end_of_table;
+  db_bool tree_end;
+  memtable_entry_t* buffered;
 } cursor_t;
 
-cursor_t* table_start(table_t* table);
-cursor_t* table_end(table_t* table);
-cursor_t* table_find(table_t* table, uint32_t key);
+void table_lock(table_t* table);
+void table_unlock(table_t* table);
+
+/* Cursors are caller-owned; these only position them */
+void table_start(table_t* table, cursor_t* cursor);
+void table_end(table_t* table, cursor_t* cursor);
+void table_find(table_t* table, uint64_t key, cursor_t* cursor);
+void table_seek(table_t* table, uint64_t key, cursor_t* cursor);
+void* table_lookup(table_t* table, uint64_t key);
+/* Re-index every row in the tree, e.g. after compaction moved the leaves */
+void table_rebuild_hash_index(table_t* table);
+/* Move every buffered row into the tree, one leaf at a time */
+void table_drain(table_t* table);
+uint64_t cursor_key(cursor_t* cursor);
 void* cursor_value(cursor_t* cursor);
 void  cursor_advance(cursor_t* cursor);
 
@@ -0,0 +1,114 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char* trace_kind_names[TRACE_KIND_COUNT] = {
+  "insert",
+  "select",
+  "select_id",
+  "meta",
+};
+
+const char* trace_kind_name(TraceKind kind) {
+  return trace_kind_names[kind];
+}
+
+static void put_varint(FILE* file, uint64_t value) {
+  while (value >= 0x80) {
+    putc((value & 0x7f) | 0x80, file);
+    value >>= 7;
+  }
+  putc(value, file);
+}
+
+static db_bool get_varint(FILE* file, uint64_t* value) {
+  *value = 0;
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    int byte = getc(file);
+    if (byte == EOF) {
+      return db_false;
+    }
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return db_true;
+    }
+  }
+  return db_false;
+}
+
+static trace_t* trace_new(FILE* file) {
+  trace_t* trace = malloc(sizeof(trace_t));
+  trace->file = file;
+  trace->first = db_true;
+  trace->last_ns = 0;
+  return trace;
+}
+
+trace_t* trace_create(const char* filename) {
+  FILE* file = fopen(filename, "wb");
+  if (file == NULL) {
+    return NULL;
+  }
+  uint32_t header[2] = {TRACE_MAGIC, TRACE_VERSION};
+  fwrite(header, sizeof(header), 1, file);
+  return trace_new(file);
+}
+
+/* Records go through stdio's buffer; the REPL pays for a write every few KiB */
+void trace_write(trace_t* trace, TraceKind kind, uint64_t start_ns, uint64_t latency_ns,
+                 const char* text, uint32_t length) {
+  uint64_t delta = trace->first ? 0 : start_ns - trace->last_ns;
+  trace->first = db_false;
+  trace->last_ns = start_ns;
+
+  putc(kind, trace->file);
+  put_varint(trace->file, delta);
+  put_varint(trace->file, latency_ns);
+  put_varint(trace->file, length);
+  fwrite(text, 1, length, trace->file);
+}
+
+trace_t* trace_open(const char* filename) {
+  FILE* file = fopen(filename, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  uint32_t header[2];
+  if (fread(header, sizeof(header), 1, file) != 1 || header[0] != TRACE_MAGIC ||
+      header[1] != TRACE_VERSION) {
+    fclose(file);
+    return NULL;
+  }
+  return trace_new(file);
+}
+
+TraceReadResult trace_read(trace_t* trace, trace_record_t* record) {
+  int kind = getc(trace->file);
+  if (kind == EOF) {
+    return TRACE_EOF;
+  }
+
+  uint64_t delta;
+  uint64_t length;
+  if (kind >= TRACE_KIND_COUNT || !get_varint(trace->file, &delta) ||
+      !get_varint(trace->file, &(record->latency_ns)) || !get_varint(trace->file, &length) ||
+      length >= MAX_BUF_SIZE ||
+      fread(record->text.buf, 1, length, trace->file) != length) {
+    return TRACE_CORRUPT;
+  }
+
+  trace->last_ns += delta;
+  record->kind = kind;
+  record->offset_ns = trace->last_ns;
+  record->text.size = length;
+  record->text.buf[length] = '\0';
+  return TRACE_RECORD;
+}
+
+db_bool trace_close(trace_t* trace) {
+  db_bool ok = !ferror(trace->file);
+  ok = fclose(trace->file) == 0 && ok;
+  free(trace);
+  return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include <stdio.h>
+#include <stdint.h>
+#include "def.h"
+#include "buffer.h"
+
+// ---------- workload trace -------------
+/*
+ * Statement stream captured by the REPL for db_replay. After a header
+ * of magic and version, one record per statement:
+ *   u8 kind, varint ns since the previous statement started,
+ *   varint latency ns, varint length, statement text
+ * Varints are LEB128, so a typical insert costs its text plus ~8 bytes.
+ */
+#define TRACE_MAGIC 0x31435254 /* "TRC1" */
+#define TRACE_VERSION 1
+
+typedef enum {
+  TRACE_INSERT,
+  TRACE_SELECT,
+  TRACE_SELECT_ID,
+  TRACE_META,
+  TRACE_KIND_COUNT
+} TraceKind;
+
+typedef enum { TRACE_RECORD, TRACE_EOF, TRACE_CORRUPT } TraceReadResult;
+
+typedef struct {
+  TraceKind kind;
+  /* Since the first statement of the trace started */
+  uint64_t offset_ns;
+  uint64_t latency_ns;
+  /* NUL terminated, like the REPL's read buffer */
+  buf_t text;
+} trace_record_t;
+
+typedef struct {
+  FILE* file;
+  db_bool first;
+  uint64_t last_ns;
+} trace_t;
+
+const char* trace_kind_name(TraceKind kind);
+
+/* NULL if the file cannot be created */
+trace_t* trace_create(const char* filename);
+/* start_ns is on the stats_now_ns() clock */
+void trace_write(trace_t* trace, TraceKind kind, uint64_t start_ns, uint64_t latency_ns,
+                 const char* text, uint32_t length);
+/* NULL if the file is missing or not a trace */
+trace_t* trace_open(const char* filename);
+TraceReadResult trace_read(trace_t* trace, trace_record_t* record);
+/* db_false if buffered records could not be written */
+db_bool trace_close(trace_t* trace);
+
+#endif
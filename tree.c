@@ -1,15 +1,31 @@
 #include "tree.h"
+#include "error.h"
 #include "def.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-#define LEAF_NODE_LEFT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT)
+#define LEAF_NODE_RIGHT_SPLIT_COUNT(max_cells) (((max_cells) + 1) / 2)
+#define LEAF_NODE_LEFT_SPLIT_COUNT(max_cells) \
+  (((max_cells) + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT(max_cells))
 
-void leaf_node_insert(cursor_t* cursor, uint32_t key, row_t* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
+/* Point the hash index, if any, at page_num for every key in that leaf */
+static void index_leaf(table_t* table, uint32_t page_num) {
+  if (table->hash_index == NULL) {
+    return;
+  }
+  void* node = get_page(table->pager, page_num);
+  for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+    hash_index_put(table->hash_index, *leaf_node_key(node, i), page_num);
+  }
+}
+
+void leaf_node_insert(cursor_t* cursor, uint64_t key, row_t* value) {
+  void* node = get_page_for_write(cursor->table->pager, cursor->page_num);
 
   uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+  if (num_cells >= LEAF_NODE_MAX_CELLS(cursor->table->pager->page_size)) {
     // Node full
     leaf_node_split_and_insert(cursor, key, value);
     return;
@@ -26,13 +42,48 @@ void leaf_node_insert(cursor_t* cursor, uint32_t key, row_t* value) {
   *(leaf_node_num_cells(node)) += 1;
   *(leaf_node_key(node, cursor->cell_num)) = key;
   serialize_row(value, leaf_node_value(node, cursor->cell_num));
+
+  if (cursor->table->hash_index != NULL) {
+    hash_index_put(cursor->table->hash_index, key, cursor->page_num);
+  }
+}
+
+/*
+Fill from the back so each existing cell moves at most once, however
+many cells come in. Existing cells below every new key stay put.
+*/
+void leaf_node_insert_cells(table_t* table, uint32_t page_num, void** cells, uint32_t count) {
+  void* node = get_page_for_write(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  int32_t old_index = (int32_t)num_cells - 1;
+  int32_t new_index = (int32_t)count - 1;
+  uint32_t destination = num_cells + count;
+  while (new_index >= 0) {
+    destination--;
+    if (old_index >= 0 && *leaf_node_key(node, old_index) > *(uint64_t*)cells[new_index]) {
+      memcpy(leaf_node_cell(node, destination), leaf_node_cell(node, old_index),
+             LEAF_NODE_CELL_SIZE);
+      old_index--;
+    } else {
+      memcpy(leaf_node_cell(node, destination), cells[new_index], LEAF_NODE_CELL_SIZE);
+      new_index--;
+    }
+  }
+
+  *leaf_node_num_cells(node) = num_cells + count;
+
+  if (table->hash_index != NULL) {
+    for (uint32_t i = 0; i < count; i++) {
+      hash_index_put(table->hash_index, *(uint64_t*)cells[i], page_num);
+    }
+  }
 }
 
-cursor_t* leaf_node_find(table_t* table, uint32_t page_num, uint32_t key) {
+void leaf_node_find(table_t* table, uint32_t page_num, uint64_t key, cursor_t* cursor) {
   void* node = get_page(table->pager, page_num);
   uint32_t num_cells = *leaf_node_num_cells(node);
 
-  cursor_t* cursor = malloc(sizeof(cursor_t));
   cursor->table = table;
   cursor->page_num = page_num;
 
@@ -41,10 +92,10 @@ cursor_t* leaf_node_find(table_t* table, uint32_t page_num, uint32_t key) {
   uint32_t one_past_max_index = num_cells;
   while (one_past_max_index != min_index) {
     uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
+    uint64_t key_at_index = *leaf_node_key(node, index);
     if (key == key_at_index) {
       cursor->cell_num = index;
-      return cursor;
+      return;
     }
     if (key < key_at_index) {
       one_past_max_index = index;
@@ -54,7 +105,6 @@ cursor_t* leaf_node_find(table_t* table, uint32_t page_num, uint32_t key) {
   }
 
   cursor->cell_num = min_index;
-  return cursor;
 }
 
 NodeKind get_node_kind(void* node) {
@@ -75,8 +125,8 @@ void* leaf_node_cell(void* node, uint32_t cell_num) {
   return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return (uint32_t*)leaf_node_cell(node, cell_num);
+uint64_t* leaf_node_key(void* node, uint32_t cell_num) {
+  return (uint64_t*)leaf_node_cell(node, cell_num);
 }
 
 void* leaf_node_value(void* node, uint32_t cell_num) {
@@ -87,20 +137,23 @@ void initialize_leaf_node(void* node) {
   set_node_kind(node, NODE_LEAF);
   set_node_root(node, db_false);
   *leaf_node_num_cells(node) = 0; 
-
-  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+  *leaf_node_next_leaf(node) = 0;
 }
 
-void leaf_node_split_and_insert(cursor_t* cursor, uint32_t key, row_t* value) {
+void leaf_node_split_and_insert(cursor_t* cursor, uint64_t key, row_t* value) {
   /*
   Create a new node and move half the cells over.
   Insert the new value in one of the two nodes.
   Update parent or create a new parent.
   */
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
+  STATS_INC(STATS_LEAF_SPLITS);
+  uint32_t max_cells = LEAF_NODE_MAX_CELLS(cursor->table->pager->page_size);
+  uint32_t left_split_count = LEAF_NODE_LEFT_SPLIT_COUNT(max_cells);
+  uint32_t right_split_count = LEAF_NODE_RIGHT_SPLIT_COUNT(max_cells);
+  void* old_node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  uint64_t old_max = get_node_max_key(cursor->table->pager, old_node);
   uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
+  void* new_node = get_page_for_write(cursor->table->pager, new_page_num);
   initialize_leaf_node(new_node);
   *node_parent(new_node) = *node_parent(old_node);
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
@@ -111,14 +164,14 @@ void leaf_node_split_and_insert(cursor_t* cursor, uint32_t key, row_t* value) {
   evenly between old (left) and new (right) nodes.
   Starting from the right, move each key to correct position.
   */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i++) {
+  for (int32_t i = max_cells; i >= 0; i--) {
     void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+    if (i >= left_split_count) {
       destination_node = new_node;
     } else {
       destination_node = old_node;
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
+    uint32_t index_within_node = i % left_split_count;
     void* destination = leaf_node_cell(destination_node, index_within_node);
 
     if (i == cursor->cell_num) {
@@ -132,15 +185,20 @@ void leaf_node_split_and_insert(cursor_t* cursor, uint32_t key, row_t* value) {
   }
 
   /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  *(leaf_node_num_cells(old_node)) = left_split_count;
+  *(leaf_node_num_cells(new_node)) = right_split_count;
+
+  index_leaf(cursor->table, new_page_num);
+  if (cursor->table->hash_index != NULL && cursor->cell_num < left_split_count) {
+    hash_index_put(cursor->table->hash_index, key, cursor->page_num);
+  }
 
   if (is_node_root(old_node)) {
     create_new_root(cursor->table, new_page_num);
   } else {
     uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
+    uint64_t new_max = get_node_max_key(cursor->table->pager, old_node);
+    void* parent = get_page_for_write(cursor->table->pager, parent_page_num);
 
     update_internal_node_key(parent, old_max, new_max);
     internal_node_insert(cursor->table, parent_page_num, new_page_num);
@@ -162,38 +220,86 @@ void create_new_root(table_t* table, uint32_t right_child_page_num) {
   New root node points to two children.
   */
 
-  void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
+  void* root = get_page_for_write(table->pager, table->root_page_num);
+  void* right_child = get_page_for_write(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
+  void* left_child = get_page_for_write(table->pager, left_child_page_num);
+
+  if (get_node_kind(root) == NODE_INTERNAL) {
+    initialize_internal_node(right_child);
+    initialize_internal_node(left_child);
+  }
 
   /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
+  memcpy(left_child, root, table->pager->page_size);
   set_node_root(left_child, db_false);
 
+  if (get_node_kind(left_child) == NODE_LEAF) {
+    index_leaf(table, left_child_page_num);
+  }
+
+  if (get_node_kind(left_child) == NODE_INTERNAL) {
+    /* Children of the old root now hang off the left child */
+    void* child;
+    for (uint32_t i = 0; i < *internal_node_num_keys(left_child); i++) {
+      child = get_page_for_write(table->pager, *internal_node_child(left_child, i));
+      *node_parent(child) = left_child_page_num;
+    }
+    child = get_page_for_write(table->pager, *internal_node_right_child(left_child));
+    *node_parent(child) = left_child_page_num;
+  }
+
   /* Root node is a new internal node with one key and two children */
+  uint64_t left_child_max_key = get_node_max_key(table->pager, left_child);
   initialize_internal_node(root);
   set_node_root(root, db_true);
+  internal_node_set_frame(root, 0, left_child_max_key > INTERNAL_NODE_MAX_DELTA);
 
   *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
+  *internal_node_cell(root, 0) = left_child_page_num;
+  internal_node_set_key(root, 0, left_child_max_key);
   *internal_node_right_child(root) = right_child_page_num;
   *node_parent(left_child) = table->root_page_num;
   *node_parent(right_child) = table->root_page_num;
 }
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
+/*
+A narrow node is searched on the stored deltas: the key is moved into
+the node's frame once, and keys outside it sort before or after every
+cell.
+*/
+uint32_t internal_node_find_child(void* node, uint64_t key) {
   uint32_t num_keys = *internal_node_num_keys(node);
 
   uint32_t min_index = 0;
   uint32_t max_index = num_keys;
 
+  if (internal_node_is_wide(node)) {
+    while (min_index != max_index) {
+      uint32_t index = (min_index + max_index) / 2;
+      uint64_t key_to_right = internal_node_key(node, index);
+      if (key_to_right >= key) {
+        max_index = index;
+      } else {
+        min_index = index + 1;
+      }
+    }
+    return min_index;
+  }
+
+  uint64_t base = *internal_node_key_base(node);
+  if (key <= base) {
+    return 0;
+  }
+  if (key - base > INTERNAL_NODE_MAX_DELTA) {
+    return num_keys;
+  }
+  uint32_t delta = key - base;
+  void* deltas = node + INTERNAL_NODE_HEADER_SIZE + INTERNAL_NODE_CHILD_SIZE;
   while (min_index != max_index) {
     uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
+    uint32_t delta_to_right = *(uint32_t*)(deltas + index * INTERNAL_NODE_CELL_SIZE);
+    if (delta_to_right >= delta) {
       max_index = index;
     } else {
       min_index = index + 1;
@@ -203,20 +309,17 @@ uint32_t internal_node_find_child(void* node, uint32_t key) {
   return min_index;
 }
 
-cursor_t* internal_node_find(table_t* table, uint32_t page_num, uint32_t key) {
+void internal_node_find(table_t* table, uint32_t page_num, uint64_t key, cursor_t* cursor) {
   void* node = get_page(table->pager, page_num);
 
-  /* Binary search to find index of child to search */
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-
-  void* child = get_page(table->pager, child_num);
-  switch (get_node_kind(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+  /* Descend iteratively; binary search picks the child at each level */
+  while (get_node_kind(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, key);
+    page_num = *internal_node_child(node, child_index);
+    node = get_page(table->pager, page_num);
   }
+
+  leaf_node_find(table, page_num, key, cursor);
 }
 
 uint32_t* internal_node_num_keys(void* node) {
@@ -227,42 +330,118 @@ uint32_t* internal_node_right_child(void* node) {
   return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
+uint64_t* internal_node_key_base(void* node) {
+  return node + INTERNAL_NODE_KEY_BASE_OFFSET;
+}
+
+db_bool internal_node_is_wide(void* node) {
+  return *((uint8_t*)(node + INTERNAL_NODE_KEY_WIDE_OFFSET));
+}
+
+static uint32_t internal_node_cell_size(void* node) {
+  return internal_node_is_wide(node) ? INTERNAL_NODE_WIDE_CELL_SIZE : INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t internal_node_max_cells(void* node, uint32_t page_size) {
+  return internal_node_is_wide(node) ? INTERNAL_NODE_WIDE_MAX_CELLS(page_size)
+                                     : INTERNAL_NODE_MAX_CELLS(page_size);
+}
+
+db_bool internal_node_key_fits(void* node, uint64_t key) {
+  uint64_t base = *internal_node_key_base(node);
+  return internal_node_is_wide(node) || (key >= base && key - base <= INTERNAL_NODE_MAX_DELTA);
+}
+
+void internal_node_set_frame(void* node, uint64_t base, db_bool wide) {
+  *internal_node_key_base(node) = base;
+  *((uint8_t*)(node + INTERNAL_NODE_KEY_WIDE_OFFSET)) = wide;
+}
+
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * internal_node_cell_size(node);
 }
 
 uint32_t* internal_node_child(void* node, uint32_t child_num) {
   uint32_t num_keys = *internal_node_num_keys(node);
   if (child_num > num_keys) {
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
+    db_fatal("Tried to access child_num %d > num_keys %d", child_num, num_keys);
   } else if (child_num == num_keys) {
     uint32_t* right_child = internal_node_right_child(node);
     if (*right_child == INVALID_PAGE_NUM) {
-      printf("Tried to access right child of node, but was invalid page\n");
-      exit(EXIT_FAILURE);
+      db_fatal("Tried to access right child of node, but was invalid page");
     }
     return right_child;
   } else {
     uint32_t* child = internal_node_cell(node, child_num);
     if (*child == INVALID_PAGE_NUM) {
-      printf("Tried to access child %d of node, but was invalid page\n", child_num);
-      exit(EXIT_FAILURE);
+      db_fatal("Tried to access child %d of node, but was invalid page", child_num);
     }
     return child;
   }
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  return (void*) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+uint64_t internal_node_key(void* node, uint32_t key_num) {
+  void* key = (void*) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+  if (internal_node_is_wide(node)) {
+    return *(uint64_t*)key;
+  }
+  return *internal_node_key_base(node) + *(uint32_t*)key;
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
+void internal_node_set_key(void* node, uint32_t key_num, uint64_t key) {
+  if (!internal_node_key_fits(node, key)) {
+    db_fatal("Key %lu does not fit internal node frame at %lu", key, *internal_node_key_base(node));
+  }
+  void* destination = (void*) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+  if (internal_node_is_wide(node)) {
+    *(uint64_t*)destination = key;
+  } else {
+    *(uint32_t*)destination = key - *internal_node_key_base(node);
+  }
+}
+
+/* Rewrite every cell for a new frame; going wide, the node must be within the wide maximum */
+static void internal_node_encode(void* node, uint64_t base, db_bool wide) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t* children = malloc(sizeof(uint32_t) * (num_keys + 1));
+  uint64_t* keys = malloc(sizeof(uint64_t) * (num_keys + 1));
+  for (uint32_t i = 0; i < num_keys; i++) {
+    children[i] = *internal_node_cell(node, i);
+    keys[i] = internal_node_key(node, i);
+  }
+
+  internal_node_set_frame(node, base, wide);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    *internal_node_cell(node, i) = children[i];
+    internal_node_set_key(node, i, keys[i]);
+  }
+  free(children);
+  free(keys);
+}
+
+/* Re-encode on a new base, narrow if every key fits above it */
+static void internal_node_reframe(void* node, uint64_t base) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  db_bool wide = db_false;
+  for (uint32_t i = 0; i < num_keys && !wide; i++) {
+    uint64_t key = internal_node_key(node, i);
+    wide = key < base || key - base > INTERNAL_NODE_MAX_DELTA;
+  }
+  internal_node_encode(node, base, wide);
+}
+
+/*
+Separators only move down, within the node's fences, so the new key
+always fits. The right child has no key to update.
+*/
+void update_internal_node_key(void* node, uint64_t old_key, uint64_t new_key) {
   uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+  if (old_child_index < *internal_node_num_keys(node)) {
+    internal_node_set_key(node, old_child_index, new_key);
+  }
 }
 
-uint32_t get_node_max_key(page_t* pager, void* node) {
+uint64_t get_node_max_key(page_t* pager, void* node) {
   switch (get_node_kind(node)) {
     case NODE_INTERNAL:
       return get_node_max_key(pager, get_page(pager, *internal_node_right_child(node)));
@@ -271,6 +450,16 @@ uint32_t get_node_max_key(page_t* pager, void* node) {
   }
 }
 
+uint32_t get_tree_depth(page_t* pager, uint32_t page_num) {
+  uint32_t depth = 1;
+  void* node = get_page(pager, page_num);
+  while (get_node_kind(node) == NODE_INTERNAL) {
+    node = get_page(pager, *internal_node_child(node, 0));
+    depth++;
+  }
+  return depth;
+}
+
 db_bool is_node_root(void* node) {
   uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
   return (db_bool)value;
@@ -285,7 +474,8 @@ void initialize_internal_node(void* node) {
   set_node_kind(node, NODE_INTERNAL);
   set_node_root(node, db_false);
   *internal_node_num_keys(node) = 0;
-  *leaf_node_next_leaf(node) = 0;
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+  internal_node_set_frame(node, 0, db_false);
 }
 
 uint32_t* leaf_node_next_leaf(void* node) {
@@ -297,18 +487,12 @@ uint32_t* node_parent(void* node) {
 }
 
 void internal_node_insert(table_t* table, uint32_t parent_page_num, uint32_t child_page_num) {
-  void* parent = get_page(table->pager, parent_page_num);
+  void* parent = get_page_for_write(table->pager, parent_page_num);
   void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(table->pager,child);
+  uint64_t child_max_key = get_node_max_key(table->pager,child);
   uint32_t index = internal_node_find_child(parent, child_max_key);
 
   uint32_t original_num_keys = *internal_node_num_keys(parent);
-
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    internal_node_split_and_insert(table, parent_page_num, child_page_num);
-    return;
-  }
-
   uint32_t right_child_page_num = *internal_node_right_child(parent);
 
   if (right_child_page_num == INVALID_PAGE_NUM) {
@@ -317,34 +501,53 @@ void internal_node_insert(table_t* table, uint32_t parent_page_num, uint32_t chi
   }
 
   void* right_child = get_page(table->pager, right_child_page_num);
+  uint64_t right_child_max_key = get_node_max_key(table->pager, right_child);
+  /* Past the right child, the key stored is the old right child's */
+  uint64_t new_key = child_max_key > right_child_max_key ? right_child_max_key : child_max_key;
+  db_bool widen = !internal_node_key_fits(parent, new_key);
+  uint32_t max_cells = widen ? INTERNAL_NODE_WIDE_MAX_CELLS(table->pager->page_size)
+                             : internal_node_max_cells(parent, table->pager->page_size);
+
+  if (original_num_keys >= max_cells) {
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+  if (widen) {
+    internal_node_encode(parent, *internal_node_key_base(parent), db_true);
+  }
+
   *internal_node_num_keys(parent) = original_num_keys + 1;
 
-  if (child_max_key > get_node_max_key(table->pager, right_child)) {
+  /*
+  New cells are written through internal_node_cell(): internal_node_child()
+  checks what the slot holds, and stale key bytes can look like an invalid page
+  */
+  if (child_max_key > right_child_max_key) {
     /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(table->pager, right_child);
+    *internal_node_cell(parent, original_num_keys) = right_child_page_num;
+    internal_node_set_key(parent, original_num_keys, right_child_max_key);
     *internal_node_right_child(parent) = child_page_num;
   } else {
     /* Make room for the new cell */
     for (uint32_t i = original_num_keys; i > index; i--) {
       void* destination = internal_node_cell(parent, i);
       void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+      memcpy(destination, source, internal_node_cell_size(parent));
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    *internal_node_cell(parent, index) = child_page_num;
+    internal_node_set_key(parent, index, child_max_key);
   }
 }
 
 void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num,
                           uint32_t child_page_num) {
+  STATS_INC(STATS_INTERNAL_SPLITS);
   uint32_t old_page_num = parent_page_num;
-  void* old_node = get_page(table->pager,parent_page_num);
-  uint32_t old_max = get_node_max_key(table->pager, old_node);
+  void* old_node = get_page_for_write(table->pager,parent_page_num);
+  uint64_t old_max = get_node_max_key(table->pager, old_node);
 
-  void* child = get_page(table->pager, child_page_num); 
-  uint32_t child_max = get_node_max_key(table->pager, child);
+  void* child = get_page_for_write(table->pager, child_page_num); 
+  uint64_t child_max = get_node_max_key(table->pager, child);
 
   uint32_t new_page_num = get_unused_page_num(table->pager);
 
@@ -367,24 +570,24 @@ void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num,
   void* new_node;
   if (splitting_root) {
     create_new_root(table, new_page_num);
-    parent = get_page(table->pager,table->root_page_num);
+    parent = get_page_for_write(table->pager,table->root_page_num);
     /*
     If we are splitting the root, we need to update old_node to point
     to the new root's left child, new_page_num will already point to
     the new root's right child
     */
     old_page_num = *internal_node_child(parent,0);
-    old_node = get_page(table->pager, old_page_num);
+    old_node = get_page_for_write(table->pager, old_page_num);
   } else {
-    parent = get_page(table->pager,*node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
+    parent = get_page_for_write(table->pager,*node_parent(old_node));
+    new_node = get_page_for_write(table->pager, new_page_num);
     initialize_internal_node(new_node);
   }
   
   uint32_t* old_num_keys = internal_node_num_keys(old_node);
 
   uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void* cur = get_page(table->pager, cur_page_num);
+  void* cur = get_page_for_write(table->pager, cur_page_num);
 
   /*
   First put right child into new node and set right child of old node to invalid page number
@@ -393,11 +596,13 @@ void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num,
   *node_parent(cur) = new_page_num;
   *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
   /*
-  For each key until you get to the middle key, move the key and the child to the new node
+  For each key until you get to the middle key, move the key and the child to the new node.
+  A node that has to go wide can split before it is full.
   */
-  for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
+  int32_t num_keys = *old_num_keys;
+  for (int32_t i = num_keys - 1; i > num_keys / 2; i--) {
     cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+    cur = get_page_for_write(table->pager, cur_page_num);
 
     internal_node_insert(table, new_page_num, cur_page_num);
     *node_parent(cur) = new_page_num;
@@ -416,7 +621,11 @@ void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num,
   Determine which of the two nodes after the split should contain the child to be inserted,
   and insert the child
   */
-  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+  uint64_t max_after_split = get_node_max_key(table->pager, old_node);
+
+  /* That is the new node's lower fence from now on, and so its base */
+  internal_node_reframe(get_page_for_write(table->pager, new_page_num), max_after_split);
+  internal_node_reframe(old_node, *internal_node_key_base(old_node));
 
   uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
 
@@ -426,18 +635,25 @@ void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num,
   update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
 
   if (!splitting_root) {
-    internal_node_insert(table,*node_parent(old_node),new_page_num);
+    /*
+    Set the parent before inserting: if the parent splits in turn, the
+    recursive split re-parents new_node and must not be overwritten here
+    */
     *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table,*node_parent(old_node),new_page_num);
   }
 }
 
-void print_constants() {
+void print_constants(page_t* pager) {
+  printf("PAGE_SIZE: %d\n", pager->page_size);
   printf("ROW_SIZE: %d\n", ROW_SIZE);
   printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
   printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
   printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS(pager->page_size));
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS(pager->page_size));
+  printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS(pager->page_size));
+  printf("INTERNAL_NODE_WIDE_MAX_CELLS: %d\n", INTERNAL_NODE_WIDE_MAX_CELLS(pager->page_size));
 }
 
 void indent(uint32_t level) {
@@ -457,20 +673,20 @@ void print_tree(page_t* pager, uint32_t page_num, uint32_t indentation_level) {
       printf("- leaf (size %d)\n", num_keys);
       for (uint32_t i = 0; i < num_keys; i++) {
         indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
+        printf("- %lu\n", *leaf_node_key(node, i));
       }
       break;
     case (NODE_INTERNAL):
       num_keys = *internal_node_num_keys(node);
       indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
+      printf("- internal (size %d%s)\n", num_keys, internal_node_is_wide(node) ? ", wide" : "");
       if (num_keys > 0) {
         for (uint32_t i = 0; i < num_keys; i++) {
           child = *internal_node_child(node, i);
           print_tree(pager, child, indentation_level + 1);
 
           indent(indentation_level + 1);
-          printf("- key %d\n", *internal_node_key(node, i));
+          printf("- key %lu\n", internal_node_key(node, i));
         }
 
         child = *internal_node_right_child(node);
@@ -26,13 +26,15 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeKind;
 /*
  * Leaf Node Body Layout
  */
-#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
+#define LEAF_NODE_KEY_SIZE sizeof(uint64_t)
 #define LEAF_NODE_KEY_OFFSET 0
 #define LEAF_NODE_VALUE_SIZE  ROW_SIZE
 #define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
 #define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
+#define LEAF_NODE_SPACE_FOR_CELLS(page_size) ((page_size) - LEAF_NODE_HEADER_SIZE)
+#define LEAF_NODE_MAX_CELLS(page_size) (LEAF_NODE_SPACE_FOR_CELLS(page_size) / LEAF_NODE_CELL_SIZE)
+/* Upper bound over every page size, for sizing arrays */
+#define LEAF_NODE_MAX_CELLS_LIMIT LEAF_NODE_MAX_CELLS(MAX_PAGE_SIZE)
 
 /*
  * Internal Node Header Layout
@@ -41,48 +43,79 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeKind;
 #define INTERNAL_NODE_NUM_KEYS_OFFSET COMMON_NODE_HEADER_SIZE
 #define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
+#define INTERNAL_NODE_KEY_BASE_SIZE sizeof(uint64_t)
+#define INTERNAL_NODE_KEY_BASE_OFFSET (INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE)
+#define INTERNAL_NODE_KEY_WIDE_SIZE sizeof(uint8_t)
+#define INTERNAL_NODE_KEY_WIDE_OFFSET (INTERNAL_NODE_KEY_BASE_OFFSET + INTERNAL_NODE_KEY_BASE_SIZE)
 #define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + \
                                            INTERNAL_NODE_NUM_KEYS_SIZE + \
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE )
-
-#define INTERNAL_NODE_MAX_CELLS 3
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE + \
+                                           INTERNAL_NODE_KEY_BASE_SIZE + \
+                                           INTERNAL_NODE_KEY_WIDE_SIZE )
 
 /*
  * Internal Node Body Layout
+ *
+ * Keys are stored frame-of-reference: as a 32 bit delta from the key
+ * base in the header, so a cell costs what it did with 32 bit keys and
+ * the deltas are searched as they are. The base is at most the node's
+ * lower fence (the separator left of it in the parent, or 0 for the
+ * leftmost node of a level), so a separator that moves down after a
+ * split still fits. A node whose keys span more than 2^32 above its
+ * base is wide: it stores whole keys in bigger cells and holds fewer.
  */
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_DELTA_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_WIDE_KEY_SIZE sizeof(uint64_t)
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
+#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_DELTA_SIZE)
+#define INTERNAL_NODE_WIDE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_WIDE_KEY_SIZE)
+#define INTERNAL_NODE_MAX_DELTA UINT32_MAX
+#define INTERNAL_NODE_MAX_CELLS(page_size) \
+  (((page_size) - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE)
+#define INTERNAL_NODE_WIDE_MAX_CELLS(page_size) \
+  (((page_size) - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_WIDE_CELL_SIZE)
 #define INVALID_PAGE_NUM UINT32_MAX
 
 #include "row.h"
 #include "table.h"
 
-void leaf_node_insert(cursor_t* cursor, uint32_t key, row_t* value);
-cursor_t* leaf_node_find(table_t* table, uint32_t page_num, uint32_t key);
+void leaf_node_insert(cursor_t* cursor, uint64_t key, row_t* value);
+/* Merge count sorted leaf cells into a leaf that has room for all of them */
+void leaf_node_insert_cells(table_t* table, uint32_t page_num, void** cells, uint32_t count);
+void leaf_node_find(table_t* table, uint32_t page_num, uint64_t key, cursor_t* cursor);
 NodeKind get_node_kind(void* node);
 void set_node_kind(void* node, NodeKind type);
-void leaf_node_split_and_insert(cursor_t* cursor, uint32_t key, row_t* value);
+void leaf_node_split_and_insert(cursor_t* cursor, uint64_t key, row_t* value);
 uint32_t get_unused_page_num(page_t* pager);
 void create_new_root(table_t* table, uint32_t right_child_page_num);
-uint32_t get_node_max_key(page_t* pager,void* node);
+uint64_t get_node_max_key(page_t* pager,void* node);
+uint32_t get_tree_depth(page_t* pager, uint32_t page_num);
 
-uint32_t internal_node_find_child(void* node, uint32_t key);
+uint32_t internal_node_find_child(void* node, uint64_t key);
 void internal_node_insert(table_t* table, uint32_t parent_page_num, uint32_t child_page_num);
 uint32_t* internal_node_num_keys(void* node);
 uint32_t* internal_node_right_child(void* node);
 uint32_t* internal_node_cell(void* node, uint32_t cell_num);
 uint32_t* internal_node_child(void* node, uint32_t child_num);
-uint32_t* internal_node_key(void* node, uint32_t key_num);
-cursor_t* internal_node_find(table_t* table, uint32_t page_num, uint32_t key);
+uint64_t internal_node_key(void* node, uint32_t key_num);
+/* The key must fit the node's frame; see internal_node_key_fits() */
+void internal_node_set_key(void* node, uint32_t key_num, uint64_t key);
+uint64_t* internal_node_key_base(void* node);
+db_bool internal_node_is_wide(void* node);
+db_bool internal_node_key_fits(void* node, uint64_t key);
+/* Cells this node can hold with its current key width */
+uint32_t internal_node_max_cells(void* node, uint32_t page_size);
+/* Choose base and width for a node that has no keys yet */
+void internal_node_set_frame(void* node, uint64_t base, db_bool wide);
+void internal_node_find(table_t* table, uint32_t page_num, uint64_t key, cursor_t* cursor);
 void internal_node_split_and_insert(table_t* table, uint32_t parent_page_num, uint32_t child_page_num);
 void initialize_internal_node(void* node);
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
+void update_internal_node_key(void* node, uint64_t old_key, uint64_t new_key);
 
 uint32_t* leaf_node_next_leaf(void* node);
 uint32_t* leaf_node_num_cells(void* node);
 void* leaf_node_cell(void* node, uint32_t cell_num);
-uint32_t* leaf_node_key(void* node, uint32_t cell_num);
+uint64_t* leaf_node_key(void* node, uint32_t cell_num);
 void* leaf_node_value(void* node, uint32_t cell_num);
 void initialize_leaf_node(void* node);
 
@@ -90,7 +123,7 @@ db_bool is_node_root(void* node);
 void set_node_root(void* node, db_bool is_root);
 uint32_t* node_parent(void* node);
 
-void print_constants();
+void print_constants(page_t* pager);
 void print_tree(page_t* pager, uint32_t page_num, uint32_t indentation_level);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,240 @@
+#include "warm.h"
+#include "error.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define WARM_MAGIC 0x314d5257 /* "WRM1" */
+#define WARM_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_pages;
+} warm_header_t;
+
+struct __warm {
+  table_t* table;
+  /* Only dereferenced under the table lock, and not once cancelled */
+  page_t* pager;
+  uint32_t page_size;
+  db_bool compressed;
+  uint32_t num_pages;
+  warm_set_t set;
+  /* Aligned for O_DIRECT: WARM_RUN_PAGES frames */
+  void* buffer;
+  pthread_t thread;
+  /* Set by warm_stop(), or by warm_cancel() under the table lock */
+  _Atomic db_bool stopping;
+};
+
+/* Takes the table lock; db_false, without it, if prefetching was cancelled */
+static db_bool warm_lock(warm_t* warm) {
+  table_lock(warm->table);
+  if (atomic_load(&(warm->stopping))) {
+    table_unlock(warm->table);
+    return db_false;
+  }
+  return db_true;
+}
+
+static char* warm_filename(const char* db_filename) {
+  size_t len = strlen(db_filename) + strlen(WARM_FILE_SUFFIX) + 1;
+  char* filename = malloc(len);
+  snprintf(filename, len, "%s%s", db_filename, WARM_FILE_SUFFIX);
+  return filename;
+}
+
+static db_bool warm_is_set(const warm_set_t* set, uint32_t page_num) {
+  return (set->resident[page_num / 64] >> (page_num % 64)) & 1;
+}
+
+void warm_snapshot(page_t* pager, warm_set_t* set) {
+  memset(set, 0, sizeof(warm_set_t));
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    if (pager->pages[i] != NULL) {
+      set->resident[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+}
+
+/* Written aside and renamed over, so a crash leaves the old list or the new one */
+void warm_save(const char* db_filename, const warm_set_t* set) {
+  char* filename = warm_filename(db_filename);
+  size_t tmp_len = strlen(filename) + 5;
+  char* tmp_filename = malloc(tmp_len);
+  snprintf(tmp_filename, tmp_len, "%s.tmp", filename);
+
+  warm_header_t header = {WARM_MAGIC, WARM_VERSION, TABLE_MAX_PAGES};
+  int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  db_bool ok = fd != -1 && write(fd, &header, sizeof(header)) == sizeof(header) &&
+               write(fd, set, sizeof(warm_set_t)) == sizeof(warm_set_t);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (ok) {
+    rename(tmp_filename, filename);
+  } else {
+    unlink(tmp_filename);
+  }
+
+  free(tmp_filename);
+  free(filename);
+}
+
+static db_bool warm_load(const char* db_filename, warm_set_t* set) {
+  char* filename = warm_filename(db_filename);
+  int fd = open(filename, O_RDONLY);
+  free(filename);
+  if (fd == -1) {
+    return db_false;
+  }
+
+  warm_header_t header;
+  db_bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+               header.magic == WARM_MAGIC && header.version == WARM_VERSION &&
+               header.num_pages == TABLE_MAX_PAGES &&
+               read(fd, set, sizeof(warm_set_t)) == sizeof(warm_set_t);
+  close(fd);
+  return ok;
+}
+
+/*
+Compressed pages are loaded through get_page() one at a time, with an
+error trap since this thread has no caller to unwind to.
+*/
+static db_bool warm_run_compressed(warm_t* warm, uint32_t first, uint32_t count) {
+  table_t* table = warm->table;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!warm_lock(warm)) {
+      return db_false;
+    }
+    if (warm->pager->pages[first + i] == NULL) {
+      db_error_trap_t trap;
+      db_error_push(&trap);
+      if (setjmp(trap.env) == 0) {
+        get_page(warm->pager, first + i);
+        db_error_pop(&trap);
+      } else {
+        table_unlock(table);
+        return db_false;
+      }
+      STATS_INC(STATS_PAGES_PREFETCHED);
+    }
+    table_unlock(table);
+  }
+  return db_true;
+}
+
+/*
+One read for the whole run, made without the table lock through a dup
+of the descriptor so a compaction cannot close it under us. A page the
+foreground loaded meanwhile is already resident, and perhaps dirty, so
+only the missing ones are installed.
+*/
+static db_bool warm_run(warm_t* warm, uint32_t first, uint32_t count) {
+  table_t* table = warm->table;
+  uint32_t page_size = warm->page_size;
+  if (warm->compressed) {
+    return warm_run_compressed(warm, first, count);
+  }
+
+  if (!warm_lock(warm)) {
+    return db_false;
+  }
+  int fd = dup(warm->pager->file_descriptor);
+  table_unlock(table);
+  if (fd == -1) {
+    return db_false;
+  }
+
+  ssize_t bytes_read = pread(fd, warm->buffer, (size_t)count * page_size,
+                             (off_t)first * page_size);
+  close(fd);
+  if (bytes_read <= 0) {
+    return db_false;
+  }
+  STATS_INC(STATS_DISK_READS);
+  STATS_ADD(STATS_BYTES_READ, bytes_read);
+
+  if (!warm_lock(warm)) {
+    return db_false;
+  }
+  for (uint32_t i = 0; i < bytes_read / page_size; i++) {
+    if (page_install(warm->pager, first + i, (char*)warm->buffer + (size_t)i * page_size)) {
+      STATS_INC(STATS_PAGES_PREFETCHED);
+    }
+  }
+  table_unlock(table);
+  return db_true;
+}
+
+static void* warm_main(void* arg) {
+  warm_t* warm = arg;
+
+  uint32_t page_num = 0;
+  while (page_num < warm->num_pages && !atomic_load(&(warm->stopping))) {
+    if (!warm_is_set(&(warm->set), page_num)) {
+      page_num++;
+      continue;
+    }
+
+    uint32_t first = page_num;
+    while (page_num < warm->num_pages && page_num - first < WARM_RUN_PAGES &&
+           warm_is_set(&(warm->set), page_num)) {
+      page_num++;
+    }
+    if (!warm_run(warm, first, page_num - first)) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/* Called from db_open(), before any other thread can touch the table */
+warm_t* warm_start(table_t* table) {
+  warm_t* warm = calloc(1, sizeof(warm_t));
+  if (!warm_load(table->pager->filename, &(warm->set))) {
+    free(warm);
+    return NULL;
+  }
+
+  warm->table = table;
+  warm->pager = table->pager;
+  warm->page_size = table->pager->page_size;
+  warm->compressed = table->pager->compressed;
+  warm->num_pages = table->pager->num_pages;
+  atomic_store(&(warm->stopping), db_false);
+  warm->buffer = mmap(NULL, (size_t)WARM_RUN_PAGES * warm->page_size,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (warm->buffer == MAP_FAILED) {
+    free(warm);
+    return NULL;
+  }
+
+  if (pthread_create(&(warm->thread), NULL, warm_main, warm) != 0) {
+    munmap(warm->buffer, (size_t)WARM_RUN_PAGES * warm->page_size);
+    free(warm);
+    return NULL;
+  }
+  return warm;
+}
+
+void warm_cancel(warm_t* warm) {
+  atomic_store(&(warm->stopping), db_true);
+}
+
+void warm_stop(warm_t* warm) {
+  atomic_store(&(warm->stopping), db_true);
+  pthread_join(warm->thread, NULL);
+  munmap(warm->buffer, (size_t)WARM_RUN_PAGES * warm->page_size);
+  free(warm);
+}
@@ -0,0 +1,35 @@
+#ifndef __WARM_H__
+#define __WARM_H__
+#include <stdint.h>
+#include "table.h"
+
+// ---------- warm restart -------------
+/*
+ * <db>.warm records which pages were resident, as a bitmap. It is
+ * written at close and after every checkpoint sweep. On open a
+ * background thread reads those pages back in page order, up to
+ * WARM_RUN_PAGES consecutive pages per read, and installs the ones the
+ * foreground has not loaded in the meantime. The file is only a hint:
+ * a missing, stale or damaged one just means a cold start.
+ */
+#define WARM_FILE_SUFFIX ".warm"
+#define WARM_RUN_PAGES 64
+
+typedef struct {
+  uint64_t resident[TABLE_MAX_PAGES / 64];
+} warm_set_t;
+
+typedef struct __warm warm_t;
+
+/* Caller holds the table lock, or is the only thread */
+void warm_snapshot(page_t* pager, warm_set_t* set);
+/* Best effort; failures are ignored */
+void warm_save(const char* db_filename, const warm_set_t* set);
+/* NULL when there is nothing to prefetch */
+warm_t* warm_start(table_t* table);
+/* Stop prefetching for good, e.g. before compaction replaces the pager; needs the table lock */
+void warm_cancel(warm_t* warm);
+/* Stop prefetching, waiting for the read in flight */
+void warm_stop(warm_t* warm);
+
+#endif